@@ -5,6 +5,9 @@
  * on their nickname. When a user identifies with NickServ, the
  * prefix is removed and they get their original nick back.
  *
+ * The registered nick list is also pushed to the ircd (ENCAP * REGNICK)
+ * so m_force_prefix can leave registered nicks alone the same way.
+ *
  * Copyright (C) 2026 Chatik / d00f
  * SPDX-License-Identifier: GPL-2.0-only
  */
@@ -13,15 +16,227 @@
 
 static const char PREFIX_CHAR = '~';
 
+static std::string_view View(const Anope::string &str)
+{
+	return std::string_view(str.str());
+}
+
+static bool HasPrefix(std::string_view nick)
+{
+	return !nick.empty() && Anope::tolower(nick[0]) == Anope::tolower(PREFIX_CHAR);
+}
+
+/* Registered nicks as casemapped 64-bit fingerprints in an open-addressed
+ * table. Each slot also records whether ~nick is registered, so one probe
+ * on the unprefixed nick answers both questions ApplyPrefix() asks. */
+class RegisteredNickSet final
+{
+public:
+	static constexpr uint64_t SELF = 1;     /* The nick itself is registered */
+	static constexpr uint64_t PREFIXED = 2; /* ~nick is registered */
+
+private:
+	static constexpr uint64_t FLAGS = SELF | PREFIXED;
+
+	/* Fingerprint in the high bits, flags in the low two; 0 is empty */
+	std::vector<uint64_t> slots;
+	size_t count = 0;
+
+	static uint64_t Fingerprint(std::string_view nick)
+	{
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (const char c : nick)
+		{
+			h ^= Anope::tolower(c);
+			h *= 0x100000001b3ULL;
+		}
+
+		/* Spread the FNV-1a result so the index bits are usable */
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h & ~FLAGS;
+	}
+
+	size_t Home(uint64_t slot) const
+	{
+		return (slot >> 2) & (slots.size() - 1);
+	}
+
+	/* Index of the slot holding fp, or of the empty slot where it would go */
+	size_t Probe(uint64_t fp) const
+	{
+		const size_t mask = slots.size() - 1;
+		size_t i = Home(fp);
+		while (slots[i] && (slots[i] & ~FLAGS) != fp)
+			i = (i + 1) & mask;
+		return i;
+	}
+
+	void Grow()
+	{
+		std::vector<uint64_t> old(std::max<size_t>(slots.size() * 2, 1024), 0);
+		old.swap(slots);
+
+		for (const uint64_t slot : old)
+			if (slot)
+				slots[Probe(slot & ~FLAGS)] = slot;
+	}
+
+	void Set(std::string_view nick, uint64_t flag)
+	{
+		if ((count + 1) * 2 > slots.size())
+			Grow();
+
+		const uint64_t fp = Fingerprint(nick);
+		const size_t i = Probe(fp);
+		if (!slots[i])
+		{
+			slots[i] = fp;
+			++count;
+		}
+		slots[i] |= flag;
+	}
+
+	void Unset(std::string_view nick, uint64_t flag)
+	{
+		if (slots.empty())
+			return;
+
+		size_t i = Probe(Fingerprint(nick));
+		if (!slots[i])
+			return;
+
+		slots[i] &= ~flag;
+		if (slots[i] & FLAGS)
+			return;
+
+		/* Backward-shift deletion keeps probe chains intact without tombstones */
+		const size_t mask = slots.size() - 1;
+		slots[i] = 0;
+		--count;
+
+		for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask)
+		{
+			if (((j - Home(slots[j])) & mask) >= ((j - i) & mask))
+			{
+				slots[i] = slots[j];
+				slots[j] = 0;
+				i = j;
+			}
+		}
+	}
+
+public:
+	/* Flags recorded for nick; 0 if neither nick nor ~nick is registered */
+	uint64_t Lookup(std::string_view nick) const
+	{
+		if (slots.empty())
+			return 0;
+
+		return slots[Probe(Fingerprint(nick))] & FLAGS;
+	}
+
+	void Add(std::string_view nick)
+	{
+		Set(nick, SELF);
+		if (HasPrefix(nick))
+			Set(nick.substr(1), PREFIXED);
+	}
+
+	void Remove(std::string_view nick)
+	{
+		Unset(nick, SELF);
+		if (HasPrefix(nick))
+			Unset(nick.substr(1), PREFIXED);
+	}
+
+	void Clear()
+	{
+		slots.clear();
+		count = 0;
+	}
+};
+
+class NSForcePrefix;
+
+/* Drives the post-burst sweep and the SVSNICK queue, once per second */
+class ForcePrefixTimer final
+	: public Timer
+{
+	NSForcePrefix *fp;
+
+public:
+	ForcePrefixTimer(Module *creator, NSForcePrefix *m)
+		: Timer(creator, 1, true)
+		, fp(m)
+	{
+	}
+
+	void Tick() override;
+};
+
 class NSForcePrefix final
 	: public Module
 {
 private:
-	/* Check if a nick is registered */
-	bool IsRegistered(const Anope::string &nick)
+	/* UIDs of users introduced during a netburst, not yet checked */
+	std::deque<Anope::string> sweep_queue;
+
+	/* A forced nick change waiting for its turn on the uplink */
+	struct PendingChange final
+	{
+		Anope::string nick;
+		bool restore;
+	};
+
+	/* SVSNICKs in send order, and the latest wanted nick per UID.
+	 * A UID whose change was dropped stays in the order queue and is
+	 * skipped when it reaches the front. */
+	std::deque<Anope::string> svsnick_queue;
+	std::unordered_map<Anope::string, PendingChange> svsnick_pending;
+
+	ForcePrefixTimer timer;
+
+	/* Users checked per timer tick during a sweep */
+	unsigned sweep_batch = 100;
+
+	/* SVSNICKs sent to the uplink per second */
+	unsigned svsnick_rate = 50;
+
+	/* Kept in sync on register, group, drop and expiry */
+	RegisteredNickSet registered;
+
+	void RebuildRegistered()
+	{
+		registered.Clear();
+		for (const auto &[_, na] : *NickAliasList)
+			registered.Add(View(na->nick));
+	}
+
+	/* Keep m_force_prefix's copy of the registered set current */
+	static void PushRegistered(const char *op, const Anope::string &nick)
 	{
-		NickAlias *na = NickAlias::Find(nick);
-		return na && na->nc;
+		if (Me && Me->IsSynced())
+			Uplink::Send("ENCAP", "*", "REGNICK", op, nick);
+	}
+
+	/* Check whether nick is one of the account's grouped nicks */
+	static bool OwnsNick(NickCore *nc, std::string_view nick)
+	{
+		if (!nc)
+			return false;
+
+		for (const auto *na : *nc->aliases)
+		{
+			const std::string_view alias = View(na->nick);
+			if (alias.length() == nick.length()
+				&& std::equal(alias.begin(), alias.end(), nick.begin(), [](char a, char b) {
+					return Anope::tolower(a) == Anope::tolower(b);
+				}))
+				return true;
+		}
+		return false;
 	}
 
 	/* Check if user is already identified */
@@ -50,48 +265,148 @@ private:
 		if (!nick.empty() && nick[0] == PREFIX_CHAR)
 			return;
 
-		/* Nick is registered — don't prefix; nick protection will handle it */
-		if (IsRegistered(nick))
-			return;
-
 		/* Check IRCd support */
 		if (!IRCD || !IRCD->CanSVSNick)
 			return;
 
-		Anope::string newNick = Anope::string(1, PREFIX_CHAR) + nick;
-
-		/* Truncate if too long */
-		if (IRCD->MaxNick && newNick.length() > IRCD->MaxNick)
-			newNick = newNick.substr(0, IRCD->MaxNick);
+		std::string_view stem = View(nick);
+		uint64_t reg = registered.Lookup(stem);
 
-		/* Check if new nick is valid and not taken */
-		if (!IRCD->IsNickValid(newNick))
+		/* Nick is registered — don't prefix; nick protection will handle it */
+		if (reg & RegisteredNickSet::SELF)
 			return;
 
+		/* Truncate if too long; the cut ~nick needs its own probe */
+		if (IRCD->MaxNick && stem.length() + 1 > IRCD->MaxNick)
+		{
+			stem = stem.substr(0, IRCD->MaxNick - 1);
+			reg = registered.Lookup(stem);
+		}
+
 		/* Don't force to ~nick if ~nick itself is registered */
-		if (IsRegistered(newNick))
+		if (reg & RegisteredNickSet::PREFIXED)
 			return;
 
-		User *existing = User::Find(newNick, true);
-		if (existing && existing != u)
-		{
-			/* ~nick already taken, nothing we can do */
+		Anope::string newNick(1, PREFIX_CHAR);
+		newNick += Anope::string(stem.data(), stem.length());
+
+		/* Check if new nick is valid; whether it is taken is checked on send */
+		if (!IRCD->IsNickValid(newNick))
 			return;
-		}
 
-		Log(LOG_DEBUG) << "ns_force_prefix: Changing " << nick << " to " << newNick;
-		IRCD->SendForceNickChange(u, newNick, Anope::CurTime);
+		QueueNickChange(u, newNick, false);
+	}
+
+	/* Queue a forced nick change; a later change for the same user replaces it */
+	void QueueNickChange(User *u, const Anope::string &newNick, bool restore)
+	{
+		auto [it, inserted] = svsnick_pending.try_emplace(u->GetUID());
+		it->second.nick = newNick;
+		it->second.restore = restore;
+
+		if (inserted)
+			svsnick_queue.push_back(u->GetUID());
+	}
+
+	/* Send up to svsnick_rate queued changes that are still wanted */
+	void SendQueuedNickChanges()
+	{
+		unsigned sent = 0;
+
+		while (sent < svsnick_rate && !svsnick_queue.empty())
+		{
+			auto it = svsnick_pending.find(svsnick_queue.front());
+			svsnick_queue.pop_front();
+
+			if (it == svsnick_pending.end())
+				continue;
+
+			const PendingChange change = it->second;
+			User *u = User::Find(it->first);
+			svsnick_pending.erase(it);
+
+			if (!u || u->Quitting() || u->nick.equals_ci(change.nick))
+				continue;
+
+			/* Identified while the prefix was waiting */
+			if (!change.restore && IsIdentified(u))
+				continue;
+
+			User *existing = User::Find(change.nick, true);
+			if (existing && existing != u)
+				continue;
+
+			if (change.restore)
+				Log(LOG_DEBUG) << "ns_force_prefix: Restoring " << u->nick << " to " << change.nick;
+			else
+				Log(LOG_DEBUG) << "ns_force_prefix: Changing " << u->nick << " to " << change.nick;
+
+			IRCD->SendForceNickChange(u, change.nick, Anope::CurTime);
+			++sent;
+		}
 	}
 
 public:
 	NSForcePrefix(const Anope::string &modname, const Anope::string &creator)
 		: Module(modname, creator, THIRD)
+		, timer(this, this)
 	{
 		this->SetAuthor("d00f");
 		this->SetVersion("1.0.0");
+
+		/* Empty at startup; filled by OnPostInit. Covers a later modload. */
+		RebuildRegistered();
+	}
+
+	void OnReload(Configuration::Conf &conf) override
+	{
+		const auto &block = conf.GetModule(this);
+		sweep_batch = std::max(block.Get<unsigned>("sweepbatch", "100"), 1U);
+		svsnick_rate = std::max(block.Get<unsigned>("svsnickrate", "50"), 1U);
+	}
+
+	void Tick()
+	{
+		SweepBatch();
+		SendQueuedNickChanges();
+	}
+
+	/* Check the next batch of burst users; called once per tick */
+	void SweepBatch()
+	{
+		for (unsigned i = 0; i < sweep_batch && !sweep_queue.empty(); ++i)
+		{
+			/* Users who quit or were already handled are skipped by ApplyPrefix */
+			User *u = User::Find(sweep_queue.front());
+			sweep_queue.pop_front();
+			ApplyPrefix(u);
+		}
 	}
 
-	/* User connects to IRC */
+	/* A server finished its burst — queue its users for the sweep */
+	void OnServerSync(Server *s) override
+	{
+		if (!s || s == Me || s->IsULined())
+			return;
+
+		size_t queued = 0;
+		for (const auto &[_, u] : UserListByNick)
+		{
+			if (u->server != s || u->Quitting() || IsIdentified(u))
+				continue;
+
+			if (!u->nick.empty() && u->nick[0] == PREFIX_CHAR)
+				continue;
+
+			sweep_queue.push_back(u->GetUID());
+			++queued;
+		}
+
+		if (queued)
+			Log(LOG_DEBUG) << "ns_force_prefix: Queued " << queued << " users from " << s->GetName() << " for prefix sweep";
+	}
+
+	/* User connects to IRC; burst users are left to the post-burst sweep */
 	void OnUserConnect(User *u, bool &exempt) override
 	{
 		if (!u || u->Quitting() || !u->server || !u->server->IsSynced())
@@ -109,11 +424,11 @@ public:
 		ApplyPrefix(u);
 	}
 
-	/* User identifies with NickServ — remove prefix */
-	void OnNickIdentify(User *u) override
+	/* Give a user who just identified their registered nick back */
+	void RestoreNick(User *u)
 	{
-		if (!u || u->Quitting())
-			return;
+		/* A prefix still waiting in the queue is no longer wanted */
+		svsnick_pending.erase(u->GetUID());
 
 		const Anope::string &nick = u->nick;
 
@@ -121,27 +436,40 @@ public:
 		if (nick.empty() || nick[0] != PREFIX_CHAR)
 			return;
 
-		Anope::string originalNick = nick.substr(1);
+		const std::string_view originalNick = View(nick).substr(1);
 
 		/* Check that the original nick belongs to the account they identified to */
-		NickAlias *na = NickAlias::Find(originalNick);
-		if (!na || !na->nc || na->nc != u->Account())
+		if (!(registered.Lookup(originalNick) & RegisteredNickSet::SELF) || !OwnsNick(u->Account(), originalNick))
 			return;
 
 		/* Check IRCd support */
 		if (!IRCD || !IRCD->CanSVSNick)
 			return;
 
-		/* Check if original nick is available */
-		User *existing = User::Find(originalNick, true);
-		if (existing && existing != u)
-		{
-			/* Someone else has the original nick */
+		/* Whether the original nick is free is checked on send */
+		QueueNickChange(u, Anope::string(originalNick.data(), originalNick.length()), true);
+	}
+
+	/* Quit users have nothing left to change */
+	void OnUserQuit(User *u, const Anope::string &msg) override
+	{
+		svsnick_pending.erase(u->GetUID());
+	}
+
+	/* The queue belongs to the uplink connection */
+	void OnServerDisconnect() override
+	{
+		svsnick_queue.clear();
+		svsnick_pending.clear();
+	}
+
+	/* User identifies with NickServ — remove prefix */
+	void OnNickIdentify(User *u) override
+	{
+		if (!u || u->Quitting())
 			return;
-		}
 
-		Log(LOG_DEBUG) << "ns_force_prefix: Restoring " << nick << " to " << originalNick;
-		IRCD->SendForceNickChange(u, originalNick, Anope::CurTime);
+		RestoreNick(u);
 	}
 
 	/* Also handle login (e.g. SASL auto-identify) */
@@ -150,28 +478,63 @@ public:
 		if (!u || u->Quitting())
 			return;
 
-		const Anope::string &nick = u->nick;
+		RestoreNick(u);
+	}
 
-		/* Only act if nick starts with ~ */
-		if (nick.empty() || nick[0] != PREFIX_CHAR)
-			return;
+	void OnNickRegister(User *user, NickAlias *na, const Anope::string &pass) override
+	{
+		registered.Add(View(na->nick));
+		PushRegistered("ADD", na->nick);
+	}
 
-		Anope::string originalNick = nick.substr(1);
+	/* The grouped nick is the user's current one */
+	void OnNickGroup(User *u, NickAlias *target) override
+	{
+		registered.Add(View(u->nick));
+		PushRegistered("ADD", u->nick);
+	}
 
-		NickAlias *na = NickAlias::Find(originalNick);
-		if (!na || !na->nc || na->nc != u->Account())
-			return;
+	/* Called from the NickAlias destructor: drops and expiry */
+	void OnDelNick(NickAlias *na) override
+	{
+		registered.Remove(View(na->nick));
+		PushRegistered("DEL", na->nick);
+	}
 
-		if (!IRCD || !IRCD->CanSVSNick)
-			return;
+	/* Full push to the ircd, about 400 bytes of nicks per line */
+	void OnUplinkSync(Server *) override
+	{
+		Uplink::Send("ENCAP", "*", "REGNICK", "CLEAR");
 
-		User *existing = User::Find(originalNick, true);
-		if (existing && existing != u)
-			return;
+		Anope::string batch;
+		for (const auto &[_, na] : *NickAliasList)
+		{
+			if (!batch.empty() && batch.length() + na->nick.length() >= 400)
+			{
+				Uplink::Send("ENCAP", "*", "REGNICK", "ADD", batch);
+				batch.clear();
+			}
+
+			if (!batch.empty())
+				batch += ' ';
+			batch += na->nick;
+		}
 
-		Log(LOG_DEBUG) << "ns_force_prefix: Restoring (login) " << nick << " to " << originalNick;
-		IRCD->SendForceNickChange(u, originalNick, Anope::CurTime);
+		if (!batch.empty())
+			Uplink::Send("ENCAP", "*", "REGNICK", "ADD", batch);
+		Uplink::Send("ENCAP", "*", "REGNICK", "END");
+	}
+
+	/* Databases are loaded by now */
+	void OnPostInit() override
+	{
+		RebuildRegistered();
 	}
 };
 
+void ForcePrefixTimer::Tick()
+{
+	fp->Tick();
+}
+
 MODULE_INIT(NSForcePrefix)
@@ -0,0 +1,225 @@
+/*
+ *  match-bench.c - microbenchmark for ircd-patch/match_simd.c
+ *
+ *  Times the byte loops of valid_nickname() and irccmp() against
+ *  match_nick_span() and the SSE2 irccmp(), after checking they agree
+ *  on random input.  Uses local copies of the RFC 1459 tables with '~'
+ *  as a nick character (docker/charclass.conf), so it builds without
+ *  the ircd tree.
+ *
+ *  Build: gcc -O2 -I../ircd-patch -o match-bench match-bench.c
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NICK_C 0x1
+
+static unsigned int char_attrs[256];
+static unsigned char tolower_tab[256], toupper_tab[256];
+
+#define IsNickChar(c) (char_attrs[(unsigned char)(c)] & NICK_C)
+#define ToLower(c)    (tolower_tab[(unsigned char)(c)])
+#define ToUpper(c)    (toupper_tab[(unsigned char)(c)])
+
+/* The core's loops, as match_simd.c finds them */
+int
+irccmp_bytewise(const char *s1, const char *s2)
+{
+  const unsigned char *str1 = (const unsigned char *)s1;
+  const unsigned char *str2 = (const unsigned char *)s2;
+
+  while (ToUpper(*str1) == ToUpper(*str2))
+  {
+    if (*str1 == '\0')
+      return 0;
+
+    ++str1;
+    ++str2;
+  }
+
+  return 1;
+}
+
+static bool
+nick_bytewise(const char *p)
+{
+  for (; *p; ++p)
+    if (!IsNickChar(*p))
+      return false;
+  return true;
+}
+
+#include "match_simd.h"
+#include "match_simd.c"
+
+
+static void
+tables_init(void)
+{
+  for (unsigned int c = 0; c < 256; ++c)
+  {
+    tolower_tab[c] = toupper_tab[c] = c;
+
+    if (c == '-' || (c >= '0' && c <= '9') || (c >= 'A' && c <= '~'))
+      char_attrs[c] |= NICK_C;
+  }
+
+  /* RFC 1459: A-Z plus [\]^ fold to a-z plus {|}~ */
+  for (unsigned int c = 'A'; c <= '^'; ++c)
+  {
+    tolower_tab[c] = c + 0x20;
+    toupper_tab[c + 0x20] = c;
+  }
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+random_nick(char *buf, size_t len, bool valid)
+{
+  static const char pool[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789[]\\^_`{|}~-";
+
+  for (size_t i = 0; i < len; ++i)
+    buf[i] = pool[rand() % (sizeof(pool) - 1)];
+  if (!valid && len)
+    buf[rand() % len] = " !@#$%&*,.\x01\xe9"[rand() % 12];
+  buf[len] = '\0';
+}
+
+/* Same string, random letters in the other case */
+static void
+recase(char *dst, const char *src)
+{
+  for (; *src; ++src, ++dst)
+    *dst = rand() & 1 ? (char)ToUpper(*src) : (char)ToLower(*src);
+  *dst = '\0';
+}
+
+/* Strings placed right before a page end exercise the byte-loop tail */
+static bool
+self_check(void)
+{
+  static char page[3 * MATCH_SIMD_PAGE] __attribute__((aligned(MATCH_SIMD_PAGE)));
+  char a[96], b[96];
+
+  for (unsigned int iter = 0; iter < 500000; ++iter)
+  {
+    const size_t len = rand() % 80;
+
+    if (rand() & 1)
+    {
+      for (size_t i = 0; i < len; ++i)
+        a[i] = rand() % 255 + 1;
+      a[len] = '\0';
+    }
+    else
+      random_nick(a, len, rand() & 1);
+
+    recase(b, a);
+    if (len && rand() & 1)
+      b[rand() % len] = rand() % 255 + 1;
+    if (rand() & 1)
+      b[rand() % (len + 1)] = '\0';
+
+    char *x = a, *y = b;
+    if (rand() & 1)
+    {
+      x = page + 2 * MATCH_SIMD_PAGE - 1 - len + rand() % 2;
+      y = page + MATCH_SIMD_PAGE - 1 - strlen(b);
+      memcpy(x, a, len + 1);
+      memcpy(y, b, strlen(b) + 1);
+    }
+
+    if ((x[match_nick_span(x)] == '\0') != nick_bytewise(x))
+      return false;
+    if ((irccmp(x, y) == 0) != (irccmp_bytewise(x, y) == 0))
+      return false;
+  }
+
+  return true;
+}
+
+#define NICKS 4096
+#define ROUNDS 200
+#define TRIES 25
+
+static void
+bench_length(size_t len)
+{
+  static char nicks[NICKS][64], other[NICKS][64];
+  volatile unsigned long sink = 0;
+
+  for (unsigned int i = 0; i < NICKS; ++i)
+  {
+    random_nick(nicks[i], len, true);
+    recase(other[i], nicks[i]);
+  }
+
+/* Best of TRIES, to keep scheduling noise out */
+#define TIME(label, expr) \
+  do { \
+    double best = 0; \
+    for (unsigned int try = 0; try < TRIES; ++try) \
+    { \
+      double t = now(); \
+      for (unsigned int r = 0; r < ROUNDS; ++r) \
+        for (unsigned int i = 0; i < NICKS; ++i) \
+          sink += (expr); \
+      t = now() - t; \
+      if (try == 0 || t < best) \
+        best = t; \
+    } \
+    printf("  %-26s %7.2f ns\n", label, best * 1e9 / ((double)ROUNDS * NICKS)); \
+  } while (0)
+
+  printf("length %zu\n", len);
+  TIME("nick check, byte loop", nick_bytewise(nicks[i]));
+  TIME("nick check, vector", nicks[i][match_nick_span(nicks[i])] == '\0');
+  TIME("irccmp equal, byte loop", irccmp_bytewise(nicks[i], other[i]));
+  TIME("irccmp equal, vector", irccmp(nicks[i], other[i]));
+  TIME("irccmp differ, byte loop", irccmp_bytewise(nicks[i], nicks[(i + 1) % NICKS]));
+  TIME("irccmp differ, vector", irccmp(nicks[i], nicks[(i + 1) % NICKS]));
+#undef TIME
+}
+
+int
+main(void)
+{
+  tables_init();
+  match_simd_init();
+  srand(1);
+
+  printf("nick ranges %u (%s), fold ranges %u (%s)\n",
+         match_simd.nick_count, match_simd.nick_vector ? "vector" : "byte loop",
+         match_simd.fold_count, match_simd.fold_vector ? "vector" : "byte loop");
+
+  if (!self_check())
+  {
+    fprintf(stderr, "vector and byte loops disagree\n");
+    return EXIT_FAILURE;
+  }
+
+  static const size_t lengths[] = { 6, 9, 16, 30 };
+  for (unsigned int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    bench_length(lengths[i]);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# run-bench.sh - start an ircd with bench/ircd.conf, drive it with
+# sasl-load (acting as its own services) and stop it cleanly.
+#
+# The clean SIGTERM shutdown matters for PGO: gcc only writes the .gcda
+# profiles from an exiting process.
+#
+# Environment:
+#   IRCD_PREFIX   installed ircd tree         (/ircd-bin)
+#   BENCH_DIR     directory with this script  (dirname $0)
+#   CLIENTS       total clients               (20000)
+#   CONCURRENCY   concurrent clients          (500)
+#   MESSAGES      channel messages per client (20)
+#   FAIL_EVERY    every Nth login fails       (10)
+#   ROUNDS        sasl-load runs per start    (3)
+#
+# After every round the ircd's resident set is printed as an RSS line,
+# so allocator comparisons see both steady-state size and growth.
+
+set -e
+
+IRCD_PREFIX=${IRCD_PREFIX:-/ircd-bin}
+BENCH_DIR=${BENCH_DIR:-$(cd "$(dirname "$0")" && pwd)}
+CLIENTS=${CLIENTS:-20000}
+CONCURRENCY=${CONCURRENCY:-500}
+MESSAGES=${MESSAGES:-20}
+FAIL_EVERY=${FAIL_EVERY:-10}
+ROUNDS=${ROUNDS:-3}
+
+run_as_ircd()
+{
+	if [ "$(id -u)" = 0 ]; then
+		su -s /bin/sh ircd -c "$*"
+	else
+		sh -c "$*"
+	fi
+}
+
+RUNDIR=$(mktemp -d /tmp/bench.XXXXXX)
+chmod 777 "$RUNDIR"
+cp "$BENCH_DIR/ircd.conf" "$BENCH_DIR/charclass.conf" "$RUNDIR/"
+
+run_as_ircd "$IRCD_PREFIX/bin/ircd -foreground -configfile $RUNDIR/ircd.conf -pidfile $RUNDIR/ircd.pid" &
+IRCD_PID=$!
+
+# The pidfile is written once the configuration is loaded
+i=0
+until [ -s "$RUNDIR/ircd.pid" ]; do
+	i=$((i + 1))
+	[ $i -lt 50 ] || { echo "ircd did not start" >&2; exit 1; }
+	sleep 0.2
+done
+sleep 1
+
+report_rss()
+{
+	pid=$(cat "$RUNDIR/ircd.pid")
+	awk -v round="$1" '
+		/^VmRSS:/ { rss = $2 }
+		/^VmHWM:/ { hwm = $2 }
+		END { printf "RSS round=%s rss_kb=%s hwm_kb=%s\n", round, rss, hwm }
+	' "/proc/$pid/status"
+}
+
+round=1
+while [ $round -le "$ROUNDS" ]; do
+	echo "==> round $round/$ROUNDS"
+	"$BENCH_DIR/sasl-load" -S -c "$CLIENTS" -n "$CONCURRENCY" \
+		-m "$MESSAGES" -f "$FAIL_EVERY" || true
+	report_rss $round
+	round=$((round + 1))
+done
+
+kill -TERM "$(cat "$RUNDIR/ircd.pid")" 2>/dev/null || kill -TERM $IRCD_PID
+wait $IRCD_PID || true
+rm -rf "$RUNDIR"
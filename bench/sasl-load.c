@@ -0,0 +1,745 @@
+/*
+ *  sasl-load.c - SASL + chat load generator for ircd-hybrid with m_sasl
+ *
+ *  Opens many client connections that each negotiate CAP sasl, log in
+ *  with AUTHENTICATE PLAIN, register, join a channel and send a few
+ *  messages.  With -S it also links to the ircd as a minimal services
+ *  server that answers ENCAP SASL, so the whole login path can be driven
+ *  without Anope.  Used for PGO training and before/after benchmarks.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+#define LINE_MAX_LEN  4096
+#define AGENT_SUFFIX  "AAAAAA"
+
+enum client_state
+{
+  ST_IDLE,          /* Not started yet */
+  ST_CONNECTING,    /* Non-blocking connect() in progress */
+  ST_WAIT_PLUS,     /* Sent AUTHENTICATE PLAIN, waiting for AUTHENTICATE + */
+  ST_WAIT_RESULT,   /* Sent credentials, waiting for 903/904 */
+  ST_WAIT_WELCOME,  /* Sent CAP END, waiting for 001 */
+  ST_CLOSING,       /* Sent QUIT, waiting for the server to close */
+  ST_DONE
+};
+
+struct conn
+{
+  int fd;
+  enum client_state state;
+  unsigned int index;
+  bool failing;            /* Uses a wrong password on purpose */
+  double auth_start;       /* Time AUTHENTICATE PLAIN was sent */
+  double deadline;
+  size_t inlen;
+  char inbuf[LINE_MAX_LEN];
+};
+
+static struct
+{
+  const char *host;
+  const char *port;
+  unsigned int clients;
+  unsigned int concurrency;
+  unsigned int messages;
+  unsigned int fail_every;
+  unsigned int timeout;
+  const char *channel;
+  const char *account;
+  const char *password;
+
+  bool services;
+  const char *link_port;
+  const char *link_password;
+  const char *link_name;
+  const char *link_sid;
+} opt =
+{
+  .host = "127.0.0.1",
+  .port = "6667",
+  .clients = 1000,
+  .concurrency = 100,
+  .messages = 10,
+  .timeout = 10,
+  .channel = "#bench",
+  .account = "bench",
+  .password = "bench",
+  .link_port = "7000",
+  .link_password = "bench",
+  .link_name = "services.bench",
+  .link_sid = "0SV",
+};
+
+static struct
+{
+  unsigned int ok;
+  unsigned int failed;
+  unsigned int timeout;
+  unsigned int errors;
+  unsigned long messages;
+  unsigned int latency_count;
+  double *latency;
+} stats;
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  exit(EXIT_FAILURE);
+}
+
+
+/* ----------------------------------------------------------------
+ * Base64 (RFC 4648) for the PLAIN payload
+ * ---------------------------------------------------------------- */
+
+static const char b64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t
+b64_encode(const unsigned char *in, size_t len, char *out)
+{
+  char *p = out;
+
+  for (size_t i = 0; i < len; i += 3)
+  {
+    unsigned int v = in[i] << 16;
+    if (i + 1 < len)
+      v |= in[i + 1] << 8;
+    if (i + 2 < len)
+      v |= in[i + 2];
+
+    *p++ = b64_alphabet[(v >> 18) & 63];
+    *p++ = b64_alphabet[(v >> 12) & 63];
+    *p++ = i + 1 < len ? b64_alphabet[(v >> 6) & 63] : '=';
+    *p++ = i + 2 < len ? b64_alphabet[v & 63] : '=';
+  }
+
+  *p = '\0';
+  return p - out;
+}
+
+static int
+b64_decode(const char *in, unsigned char *out, size_t outlen)
+{
+  unsigned int v = 0, bits = 0;
+  size_t n = 0;
+
+  for (; *in && *in != '='; ++in)
+  {
+    const char *pos = strchr(b64_alphabet, *in);
+    if (pos == NULL)
+      return -1;
+
+    v = (v << 6) | (pos - b64_alphabet);
+    bits += 6;
+
+    if (bits >= 8)
+    {
+      bits -= 8;
+      if (n == outlen)
+        return -1;
+      out[n++] = (v >> bits) & 0xFF;
+    }
+  }
+
+  return n;
+}
+
+
+/* ----------------------------------------------------------------
+ * Socket helpers
+ * ---------------------------------------------------------------- */
+
+static int
+open_socket(const char *host, const char *port, bool blocking)
+{
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *res;
+
+  if (getaddrinfo(host, port, &hints, &res))
+    return -1;
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd < 0)
+  {
+    freeaddrinfo(res);
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (!blocking)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  if (connect(fd, res->ai_addr, res->ai_addrlen) && errno != EINPROGRESS)
+  {
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+  return fd;
+}
+
+static bool
+send_line(int fd, const char *fmt, ...)
+{
+  char buf[LINE_MAX_LEN];
+  va_list args;
+
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf) - 2, fmt, args);
+  va_end(args);
+
+  if (len < 0 || (size_t)len >= sizeof(buf) - 2)
+    return false;
+
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+
+  /* Lines are short; a full socket buffer means the peer is not reading */
+  return send(fd, buf, len, MSG_NOSIGNAL) == len;
+}
+
+/*
+ * Split the next complete line out of a receive buffer.  Returns NULL
+ * when no full line is buffered.  The returned line is NUL-terminated
+ * in place and stays valid until the buffer is compacted.
+ */
+static char *
+next_line(char *buf, size_t *len, size_t *consumed)
+{
+  char *start = buf + *consumed;
+  char *nl = memchr(start, '\n', *len - *consumed);
+
+  if (nl == NULL)
+    return NULL;
+
+  *consumed = nl - buf + 1;
+  if (nl > start && nl[-1] == '\r')
+    --nl;
+  *nl = '\0';
+  return start;
+}
+
+static void
+compact(char *buf, size_t *len, size_t consumed)
+{
+  memmove(buf, buf + consumed, *len - consumed);
+  *len -= consumed;
+}
+
+static int
+tokenize(char *line, char *tok[], int max)
+{
+  int n = 0;
+
+  while (*line && n < max)
+  {
+    if (*line == ':' && n)
+    {
+      tok[n++] = line + 1;
+      break;
+    }
+
+    tok[n++] = line;
+    line = strchr(line, ' ');
+    if (line == NULL)
+      break;
+    *line++ = '\0';
+  }
+
+  return n;
+}
+
+
+/* ----------------------------------------------------------------
+ * Fake services link (-S)
+ * ---------------------------------------------------------------- */
+
+static int link_fd = -1;
+static size_t link_inlen;
+static char link_inbuf[LINE_MAX_LEN * 4];
+
+static void
+link_handle_encap_sasl(char *tok[], int n)
+{
+  /* tok: :sid ENCAP * SASL uid agent type data */
+  if (n < 7)
+    return;
+
+  const char *uid = tok[4];
+  const char *type = tok[6];
+
+  if (type[0] == 'S')
+    send_line(link_fd, ":%s ENCAP * SASL %s" AGENT_SUFFIX " %s C +",
+              opt.link_sid, opt.link_sid, uid);
+  else if (type[0] == 'C' && n >= 8)
+  {
+    unsigned char plain[512];
+    int len = b64_decode(tok[7], plain, sizeof(plain) - 1);
+    bool ok = false;
+    const char *authcid = NULL;
+
+    if (len > 0)
+    {
+      plain[len] = '\0';
+
+      /* authzid \0 authcid \0 password */
+      const char *p = memchr(plain, '\0', len);
+      if (p && p + 1 < (const char *)plain + len)
+      {
+        authcid = p + 1;
+        const char *pass = memchr(authcid, '\0', (const char *)plain + len - authcid);
+        if (pass)
+          ok = strcmp(pass + 1, opt.password) == 0;
+      }
+    }
+
+    if (ok)
+      send_line(link_fd, ":%s ENCAP * SVSLOGIN %s * * * %s",
+                opt.link_sid, uid, authcid);
+    send_line(link_fd, ":%s ENCAP * SASL %s" AGENT_SUFFIX " %s D %c",
+              opt.link_sid, opt.link_sid, uid, ok ? 'S' : 'F');
+  }
+}
+
+/* Returns true once the ircd has finished its burst towards us */
+static bool
+link_read(void)
+{
+  bool synced = false;
+  ssize_t r = recv(link_fd, link_inbuf + link_inlen, sizeof(link_inbuf) - link_inlen, 0);
+
+  if (r <= 0)
+    die("services link closed");
+  link_inlen += r;
+
+  size_t consumed = 0;
+  char *line;
+
+  while ((line = next_line(link_inbuf, &link_inlen, &consumed)))
+  {
+    char *tok[10];
+    int n = tokenize(line, tok, 10);
+
+    if (n >= 2 && strcmp(tok[0], "PING") == 0)
+      send_line(link_fd, ":%s PONG %s :%s", opt.link_sid, opt.link_name, tok[1]);
+    else if (n >= 1 && strcmp(tok[0], "ERROR") == 0)
+      die("services link rejected: %s", n >= 2 ? tok[1] : "");
+    else if (n >= 3 && strcmp(tok[1], "PING") == 0)
+      send_line(link_fd, ":%s PONG %s :%s", opt.link_sid, opt.link_name, tok[2]);
+    else if (n >= 2 && (strcmp(tok[1], "EOB") == 0 || strcmp(tok[0], "SVINFO") == 0))
+      synced = true;
+    else if (n >= 4 && strcmp(tok[1], "ENCAP") == 0 && strcmp(tok[3], "SASL") == 0)
+      link_handle_encap_sasl(tok, n);
+  }
+
+  compact(link_inbuf, &link_inlen, consumed);
+  return synced;
+}
+
+static void
+link_connect(void)
+{
+  link_fd = open_socket(opt.host, opt.link_port, true);
+  if (link_fd < 0)
+    die("cannot connect services link to %s:%s", opt.host, opt.link_port);
+
+  send_line(link_fd, "PASS %s", opt.link_password);
+  send_line(link_fd, "CAPAB :ENCAP TBURST EOB RHOST MLOCK");
+  send_line(link_fd, "SERVER %s 1 %s + :sasl-load services", opt.link_name, opt.link_sid);
+  send_line(link_fd, "SVINFO 6 6 0 :%ld", (long)time(NULL));
+  send_line(link_fd, ":%s EOB", opt.link_sid);
+
+  /* Wait for the ircd to finish bursting before we start clients */
+  while (!link_read())
+    ;
+}
+
+
+/* ----------------------------------------------------------------
+ * Clients
+ * ---------------------------------------------------------------- */
+
+static void
+client_start(struct conn *c)
+{
+  c->fd = open_socket(opt.host, opt.port, false);
+  if (c->fd < 0)
+  {
+    ++stats.errors;
+    c->state = ST_DONE;
+    return;
+  }
+
+  c->state = ST_CONNECTING;
+  c->failing = opt.fail_every && (c->index % opt.fail_every) == 0;
+  c->deadline = now() + opt.timeout;
+  c->inlen = 0;
+}
+
+static void
+client_finish(struct conn *c, enum client_state why)
+{
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+
+  if (why == ST_IDLE)
+    ++stats.errors;
+  c->state = ST_DONE;
+}
+
+static void
+client_send_credentials(struct conn *c)
+{
+  char plain[256], encoded[400];
+  int len = snprintf(plain, sizeof(plain), "%s%c%s%c%s",
+                     opt.account, '\0', opt.account, '\0',
+                     c->failing ? "wrong" : opt.password);
+
+  b64_encode((const unsigned char *)plain, len, encoded);
+  send_line(c->fd, "AUTHENTICATE %s", encoded);
+  c->state = ST_WAIT_RESULT;
+}
+
+static void
+client_auth_done(struct conn *c, bool ok)
+{
+  if (ok)
+  {
+    ++stats.ok;
+    stats.latency[stats.latency_count++] = now() - c->auth_start;
+  }
+  else
+    ++stats.failed;
+
+  send_line(c->fd, "CAP END");
+  c->state = ST_WAIT_WELCOME;
+}
+
+static void
+client_chat(struct conn *c)
+{
+  send_line(c->fd, "JOIN %s", opt.channel);
+
+  for (unsigned int i = 0; i < opt.messages; ++i)
+    if (send_line(c->fd, "PRIVMSG %s :load message %u from client %u", opt.channel, i, c->index))
+      ++stats.messages;
+
+  send_line(c->fd, "QUIT :done");
+  c->state = ST_CLOSING;
+}
+
+static void
+client_line(struct conn *c, char *line)
+{
+  char *tok[4];
+  int n = tokenize(line, tok, 4);
+
+  if (n >= 2 && strcmp(tok[0], "PING") == 0)
+  {
+    send_line(c->fd, "PONG :%s", tok[1]);
+    return;
+  }
+
+  if (n >= 2 && strcmp(tok[0], "AUTHENTICATE") == 0)
+  {
+    if (c->state == ST_WAIT_PLUS && strcmp(tok[1], "+") == 0)
+      client_send_credentials(c);
+    return;
+  }
+
+  if (n < 2)
+    return;
+
+  const char *cmd = tok[1];
+
+  if (strcmp(cmd, "903") == 0 && c->state == ST_WAIT_RESULT)
+    client_auth_done(c, true);
+  else if ((strcmp(cmd, "904") == 0 || strcmp(cmd, "906") == 0) &&
+           (c->state == ST_WAIT_PLUS || c->state == ST_WAIT_RESULT))
+    client_auth_done(c, false);
+  else if (strcmp(cmd, "001") == 0 && c->state == ST_WAIT_WELCOME)
+    client_chat(c);
+}
+
+static void
+client_read(struct conn *c)
+{
+  ssize_t r = recv(c->fd, c->inbuf + c->inlen, sizeof(c->inbuf) - c->inlen, 0);
+
+  if (r <= 0)
+  {
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    client_finish(c, c->state == ST_CLOSING ? ST_DONE : ST_IDLE);
+    return;
+  }
+
+  c->inlen += r;
+
+  size_t consumed = 0;
+  char *line;
+
+  while (c->fd >= 0 && (line = next_line(c->inbuf, &c->inlen, &consumed)))
+    client_line(c, line);
+
+  if (c->fd >= 0)
+  {
+    compact(c->inbuf, &c->inlen, consumed);
+    if (c->inlen == sizeof(c->inbuf))
+      c->inlen = 0;  /* Overlong line; drop it */
+  }
+}
+
+static void
+client_connected(struct conn *c)
+{
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err)
+  {
+    client_finish(c, ST_IDLE);
+    return;
+  }
+
+  send_line(c->fd, "CAP LS 302");
+  send_line(c->fd, "CAP REQ :sasl");
+  send_line(c->fd, "NICK l%u", c->index);
+  send_line(c->fd, "USER load 0 * :sasl-load");
+  send_line(c->fd, "AUTHENTICATE PLAIN");
+
+  c->auth_start = now();
+  c->state = ST_WAIT_PLUS;
+}
+
+
+/* ----------------------------------------------------------------
+ * Main loop and report
+ * ---------------------------------------------------------------- */
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(double p)
+{
+  if (stats.latency_count == 0)
+    return 0;
+
+  unsigned int i = p * (stats.latency_count - 1);
+  return stats.latency[i] * 1000.0;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -h host      ircd address (127.0.0.1)\n"
+    "  -p port      client port (6667)\n"
+    "  -c count     total clients (1000)\n"
+    "  -n count     concurrent clients (100)\n"
+    "  -m count     channel messages per client (10)\n"
+    "  -f N         every Nth client uses a wrong password (off)\n"
+    "  -t seconds   per-client timeout (10)\n"
+    "  -j channel   channel to join (#bench)\n"
+    "  -a account   PLAIN account (bench)\n"
+    "  -w password  PLAIN password (bench)\n"
+    "  -S           link as fake services and answer ENCAP SASL\n"
+    "  -L port      server link port (7000)\n"
+    "  -P password  server link password (bench)\n"
+    "  -N name      services server name (services.bench)\n"
+    "  -I sid       services server SID (0SV)\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, "h:p:c:n:m:f:t:j:a:w:SL:P:N:I:")) != -1)
+  {
+    switch (ch)
+    {
+      case 'h': opt.host = optarg; break;
+      case 'p': opt.port = optarg; break;
+      case 'c': opt.clients = strtoul(optarg, NULL, 10); break;
+      case 'n': opt.concurrency = strtoul(optarg, NULL, 10); break;
+      case 'm': opt.messages = strtoul(optarg, NULL, 10); break;
+      case 'f': opt.fail_every = strtoul(optarg, NULL, 10); break;
+      case 't': opt.timeout = strtoul(optarg, NULL, 10); break;
+      case 'j': opt.channel = optarg; break;
+      case 'a': opt.account = optarg; break;
+      case 'w': opt.password = optarg; break;
+      case 'S': opt.services = true; break;
+      case 'L': opt.link_port = optarg; break;
+      case 'P': opt.link_password = optarg; break;
+      case 'N': opt.link_name = optarg; break;
+      case 'I': opt.link_sid = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (opt.clients == 0 || opt.concurrency == 0)
+    usage(argv[0]);
+  if (opt.concurrency > opt.clients)
+    opt.concurrency = opt.clients;
+
+  struct conn *conns = calloc(opt.concurrency, sizeof(*conns));
+  struct pollfd *pfds = calloc(opt.concurrency + 1, sizeof(*pfds));
+  stats.latency = calloc(opt.clients, sizeof(*stats.latency));
+  if (conns == NULL || pfds == NULL || stats.latency == NULL)
+    die("out of memory");
+
+  if (opt.services)
+    link_connect();
+
+  unsigned int started = 0, finished = 0;
+  double begin = now();
+
+  for (unsigned int i = 0; i < opt.concurrency; ++i)
+  {
+    conns[i].fd = -1;
+    conns[i].state = ST_IDLE;
+  }
+
+  while (finished < opt.clients)
+  {
+    nfds_t nfds = 0;
+
+    if (link_fd >= 0)
+      pfds[nfds++] = (struct pollfd){ .fd = link_fd, .events = POLLIN };
+
+    for (unsigned int i = 0; i < opt.concurrency; ++i)
+    {
+      struct conn *c = &conns[i];
+
+      if (c->state == ST_DONE)
+      {
+        ++finished;
+        c->state = ST_IDLE;
+      }
+
+      if (c->state == ST_IDLE && started < opt.clients)
+      {
+        c->index = started++;
+        client_start(c);
+        if (c->state == ST_DONE)
+        {
+          ++finished;
+          c->state = ST_IDLE;
+        }
+      }
+
+      if (c->fd >= 0 && now() > c->deadline)
+      {
+        ++stats.timeout;
+        close(c->fd);
+        c->fd = -1;
+        c->state = ST_IDLE;
+        ++finished;
+      }
+
+      if (c->fd >= 0)
+        pfds[nfds++] = (struct pollfd){ .fd = c->fd,
+                                        .events = c->state == ST_CONNECTING ? POLLOUT : POLLIN };
+    }
+
+    if (nfds == 0 || (link_fd >= 0 && nfds == 1 && started == opt.clients))
+      break;
+
+    if (poll(pfds, nfds, 100) < 0 && errno != EINTR)
+      die("poll: %s", strerror(errno));
+
+    for (nfds_t i = 0; i < nfds; ++i)
+    {
+      if (pfds[i].revents == 0)
+        continue;
+
+      if (pfds[i].fd == link_fd)
+      {
+        link_read();
+        continue;
+      }
+
+      for (unsigned int j = 0; j < opt.concurrency; ++j)
+      {
+        struct conn *c = &conns[j];
+        if (c->fd != pfds[i].fd)
+          continue;
+
+        if (c->state == ST_CONNECTING)
+          client_connected(c);
+        else
+          client_read(c);
+        break;
+      }
+    }
+  }
+
+  double elapsed = now() - begin;
+  qsort(stats.latency, stats.latency_count, sizeof(*stats.latency), cmp_double);
+
+  printf("clients      %u (ok %u, failed %u, timeout %u, errors %u)\n",
+         opt.clients, stats.ok, stats.failed, stats.timeout, stats.errors);
+  printf("elapsed      %.2f s (%.1f logins/s)\n", elapsed, stats.ok / elapsed);
+  printf("messages     %lu\n", stats.messages);
+  printf("sasl latency p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+         percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0));
+  printf("RESULT logins_per_sec=%.1f p50_ms=%.2f p99_ms=%.2f ok=%u failed=%u timeout=%u\n",
+         stats.ok / elapsed, percentile(0.50), percentile(0.99),
+         stats.ok, stats.failed, stats.timeout);
+
+  if (link_fd >= 0)
+    close(link_fd);
+
+  return stats.errors || stats.timeout ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#!/bin/sh
+#
+# build-ircd.sh - configure, build and install ircd-hybrid with m_sasl
+#
+# Usage: build-ircd.sh <ircd-hybrid source dir>
+#
+#   IRCD_BUILD=shared  our modules are built on their own and dlopened
+#                      through hand-written .la stubs (default)
+#   IRCD_BUILD=pgo     our modules are linked into the ircd binary together
+#                      with the stock ones, built with LTO, trained with
+#                      bench/run-bench.sh and rebuilt with the profile
+#
+#   MALLOC=system      libc (musl) allocator (default)
+#   MALLOC=mimalloc    link libmimalloc, overriding malloc/free
+#   MALLOC=jemalloc    link libjemalloc, overriding malloc/free
+#
+#   BENCH=no           bench tools only live for the PGO training run (default)
+#   BENCH=yes          install them in $PREFIX/bench for make bench-*
+#
+# Expects the module sources (ircd-module/*.c) in /tmp/modules and the
+# bench/ directory in /tmp/bench.
+
+set -e
+
+SRC=$1
+PREFIX=/ircd-bin
+IRCD_BUILD=${IRCD_BUILD:-shared}
+PGO_DIR=/tmp/pgo-data
+MODULES="m_sasl m_force_prefix m_charclass"
+MALLOC=${MALLOC:-system}
+BENCH=${BENCH:-no}
+
+# --no-as-needed keeps the allocator in DT_NEEDED even though no object
+# references its own symbols; it only replaces malloc and friends.
+case "$MALLOC" in
+	system)
+		MALLOC_LIBS=
+		;;
+	mimalloc|jemalloc)
+		MALLOC_LIBS="-Wl,--no-as-needed -l$MALLOC"
+		;;
+	*)
+		echo "build-ircd.sh: unknown MALLOC '$MALLOC' (system, mimalloc or jemalloc)" >&2
+		exit 1
+		;;
+esac
+
+configure_ircd()
+{
+	cd "$SRC"
+	./configure --prefix=$PREFIX --enable-openssl LIBS="$MALLOC_LIBS" "$@"
+}
+
+build_bench()
+{
+	mkdir -p $PREFIX/bench
+	gcc -O2 -Wall -o $PREFIX/bench/sasl-load /tmp/bench/sasl-load.c
+	cp /tmp/bench/run-bench.sh /tmp/bench/ircd.conf /tmp/bench/charclass.conf $PREFIX/bench/
+}
+
+build_shared()
+{
+	configure_ircd
+	make
+	make install
+
+	for m in $MODULES; do
+		install_shared_module $m
+	done
+}
+
+# Compile a module against the source tree and install it with a .la stub
+install_shared_module()
+{
+	gcc -O2 -Wall -fPIC -shared \
+		-I"$SRC" -I"$SRC/src" -I"$SRC/libio/src" \
+		-DHAVE_CONFIG_H \
+		-o /tmp/$1.so /tmp/modules/$1.c
+	cp /tmp/$1.so $PREFIX/lib/ircd-hybrid/modules/$1.so
+	printf '%s\n' \
+		"# $1.la - a libtool library file" \
+		"dlname='$1.so'" \
+		"library_names='$1.so $1.so $1.so'" \
+		"old_library=''" \
+		"inherited_linker_flags=''" \
+		"dependency_libs=' -lssl -lcrypto -ljansson'" \
+		"weak_library_names=''" \
+		"current=0" \
+		"age=0" \
+		"revision=0" \
+		"installed=yes" \
+		"shouldnotlink=yes" \
+		"dlopen=''" \
+		"dlpreopen=''" \
+		"libdir='$PREFIX/lib/ircd-hybrid/modules'" \
+		> $PREFIX/lib/ircd-hybrid/modules/$1.la
+	rm -f /tmp/$1.so
+}
+
+# Add a module to the module lists so --disable-shared links it into the
+# binary the same way as the stock modules.  Works for both plain lists
+# ("m_accept.la") and preopen flags ("-dlopen ../modules/m_accept.la").
+add_core_module()
+{
+	cp /tmp/modules/$1.c "$SRC/modules/$1.c"
+	sed -i -E "s@(-dlopen +)?([^ ]*)m_accept\\.la@& \\1\\2$1.la@" \
+		"$SRC/modules/Makefile.am" "$SRC/src/Makefile.am"
+	grep -q "$1\\.la" "$SRC/modules/Makefile.am" || {
+		echo "build-ircd.sh: cannot find the module list in modules/Makefile.am" >&2
+		exit 1
+	}
+}
+
+build_lto()
+{
+	make clean >/dev/null 2>&1 || true
+	configure_ircd --disable-shared \
+		AR=gcc-ar RANLIB=gcc-ranlib NM=gcc-nm \
+		CFLAGS="-O2 -flto=auto $1" LDFLAGS="-flto=auto $1"
+	make
+	make install
+}
+
+build_pgo()
+{
+	for m in $MODULES; do
+		add_core_module $m
+	done
+	(cd "$SRC" && autoreconf -fi)
+
+	echo "==> PGO stage 1: instrumented build"
+	rm -rf $PGO_DIR
+	mkdir -p $PGO_DIR
+	chmod 777 $PGO_DIR
+	build_lto "-fprofile-generate=$PGO_DIR"
+
+	echo "==> PGO stage 2: training run"
+	build_bench
+	chown -R ircd:ircd $PREFIX
+	CLIENTS=${PGO_CLIENTS:-5000} ROUNDS=${PGO_ROUNDS:-2} \
+		IRCD_PREFIX=$PREFIX BENCH_DIR=$PREFIX/bench $PREFIX/bench/run-bench.sh
+	find $PGO_DIR -name '*.gcda' | grep -q . || {
+		echo "build-ircd.sh: training run produced no profile data" >&2
+		exit 1
+	}
+	rm -rf $PREFIX/bench
+
+	echo "==> PGO stage 3: optimized build"
+	build_lto "-fprofile-use=$PGO_DIR -fprofile-partial-training -Wno-missing-profile"
+	rm -rf $PGO_DIR
+}
+
+case "$IRCD_BUILD" in
+	shared)
+		build_shared
+		;;
+	pgo)
+		build_pgo
+		;;
+	*)
+		echo "build-ircd.sh: unknown IRCD_BUILD '$IRCD_BUILD' (shared or pgo)" >&2
+		exit 1
+		;;
+esac
+
+# The fake services in sasl-load have no place in a production image
+if [ "$BENCH" = yes ]; then
+	build_bench
+fi
@@ -0,0 +1,31 @@
+/^valid_nickname\(/ { in_valid = 1 }
+in_valid && /^}/ { in_valid = 0 }
+
+# for (; *p; ++p) / if (!IsNickChar(*p)) / return false;  ->  one span scan
+in_valid && /^  for \(; \*[a-z_]+; \+\+[a-z_]+\)$/ {
+  var = $0
+  sub(/^  for \(; \*/, "", var)
+  sub(/;.*/, "", var)
+
+  if ($0 == "  for (; *" var "; ++" var ")" &&
+      (getline check) > 0 && check == "    if (!IsNickChar(*" var "))" &&
+      (getline ret) > 0 && ret ~ /^      return [a-z]+;$/)
+  {
+    sub(/^      /, "    ", ret)
+    print "  " var " += match_nick_span(" var ");"
+    print "  if (*" var ")"
+    print ret
+    done = 1
+    next
+  }
+
+  # Not the loop after all: pass through what was read
+  print
+  if (check != "")
+    print check
+  if (ret != "")
+    print ret
+  next
+}
+{ print }
+END { if (!done) { print "patch_match.awk: valid_nickname() loop not found" > "/dev/stderr"; exit 1 } }
@@ -0,0 +1,360 @@
+/*
+ *  m_charclass.c - Runtime nick/user/channel character classes for
+ *  ircd-hybrid 8.2.x
+ *
+ *  Reads charclass.conf from the directory holding ircd.conf and
+ *  compiles it into libio's char_attrs table, on load, on every plain
+ *  REHASH, and whenever the file changes (checked every CHARCLASS_CHECK
+ *  seconds, so a SIGHUP rehash after an edit is picked up too).  The core keeps testing characters with one load and
+ *  one mask (IsNickChar() etc.); only the table contents change.
+ *
+ *  charclass.conf, one rule per line:
+ *
+ *    # allow ~ in nicks (needed by ns_force_prefix / m_force_prefix)
+ *    nick += "~"
+ *    user -= "^"
+ *    chan += "\xe9"
+ *
+ *  Rules apply on top of the compiled-in table, so removing a line and
+ *  rehashing restores the default.  A file with errors is rejected as a
+ *  whole and the previous table stays in effect.
+ *
+ *  Needs char_attrs to be writable (docker/Dockerfile drops the const),
+ *  and rederives the core's vector nick scan (ircd-patch/match_simd.c)
+ *  after every change to it.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "stdinc.h"
+#include "module.h"
+#include "client.h"
+#include "conf.h"
+#include "ircd.h"
+#include "match.h"
+#include "parse.h"
+#include "send.h"
+#include "user.h"
+#include "event.h"
+#include "io_string.h"
+
+#include <sys/stat.h>
+
+
+#define CHARCLASS_FILE "charclass.conf"
+
+#ifndef CHARCLASS_CHECK
+#define CHARCLASS_CHECK 5  /* Seconds between stat()s of charclass.conf */
+#endif
+
+/* Characters each class may never gain: they delimit protocol fields */
+static const struct
+{
+  const char *name;
+  unsigned int flag;
+  const char *forbidden;
+} charclass_names[] =
+{
+  { "nick", NICK_C, " ,*?!@.:#$&" },
+  { "user", USER_C, " ,*?!@:" },
+  { "chan", CHAN_C, " ,:\a" },
+  { NULL, 0, NULL }
+};
+
+/* char_attrs as compiled into the ircd, restored on unload */
+static __typeof__(char_attrs[0]) charclass_defaults[256];
+
+/* charclass.conf as last loaded; any difference means reload */
+struct charclass_stamp
+{
+  bool exists;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+static struct charclass_stamp charclass_loaded;
+
+/* The core REHASH handler we wrap */
+static struct Command *rehash_cmd;
+static void (*rehash_handler)(struct Client *, int, char *[]);
+
+
+/* ----------------------------------------------------------------
+ * charclass.conf parsing
+ * ---------------------------------------------------------------- */
+
+static int
+charclass_hex(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Parse a "quoted" character list with \\, \" and \xNN escapes */
+static bool
+charclass_parse_chars(const char *p, bool set[256])
+{
+  if (*p++ != '"')
+    return false;
+
+  for (; *p != '"'; ++p)
+  {
+    unsigned char c = *p;
+
+    if (c == '\0')
+      return false;
+
+    if (c == '\\')
+    {
+      ++p;
+      if (*p == 'x')
+      {
+        int hi = charclass_hex(p[1]), lo = hi < 0 ? -1 : charclass_hex(p[2]);
+        if (lo < 0)
+          return false;
+        c = hi << 4 | lo;
+        p += 2;
+      }
+      else if (*p == '\\' || *p == '"')
+        c = *p;
+      else
+        return false;
+    }
+
+    set[c] = true;
+  }
+
+  return true;
+}
+
+/* Apply one "class +=|-= "chars"" line to table; NULL on success */
+static const char *
+charclass_parse_line(char *line, __typeof__(char_attrs[0]) table[256])
+{
+  char *p = line;
+
+  while (*p == ' ' || *p == '\t')
+    ++p;
+
+  unsigned int i = 0;
+  for (; charclass_names[i].name; ++i)
+  {
+    size_t len = strlen(charclass_names[i].name);
+    if (strncmp(p, charclass_names[i].name, len) == 0 && (p[len] == ' ' || p[len] == '\t'))
+    {
+      p += len;
+      break;
+    }
+  }
+
+  if (charclass_names[i].name == NULL)
+    return "unknown class (nick, user or chan)";
+
+  while (*p == ' ' || *p == '\t')
+    ++p;
+
+  if ((p[0] != '+' && p[0] != '-') || p[1] != '=')
+    return "expected += or -=";
+
+  const bool add = p[0] == '+';
+  p += 2;
+
+  while (*p == ' ' || *p == '\t')
+    ++p;
+
+  bool set[256] = { false };
+  if (!charclass_parse_chars(p, set))
+    return "bad character list";
+
+  for (unsigned int c = 0; c < 256; ++c)
+  {
+    if (!set[c])
+      continue;
+
+    if (add && (c < 0x20 || strchr(charclass_names[i].forbidden, c)))
+      return "character not allowed in this class";
+
+    if (add)
+      table[c] |= charclass_names[i].flag;
+    else
+      table[c] &= ~charclass_names[i].flag;
+  }
+
+  return NULL;
+}
+
+/* charclass.conf lives next to ircd.conf */
+static void
+charclass_path(char *buf, size_t size)
+{
+  const char *conf = ConfigGeneral.configfile;
+  const char *slash = conf ? strrchr(conf, '/') : NULL;
+
+  if (slash)
+    snprintf(buf, size, "%.*s/%s", (int)(slash - conf), conf, CHARCLASS_FILE);
+  else
+    strlcpy(buf, CHARCLASS_FILE, size);
+}
+
+static void
+charclass_stat(const char *path, struct charclass_stamp *stamp)
+{
+  struct stat st;
+
+  memset(stamp, 0, sizeof(*stamp));
+  if (stat(path, &st))
+    return;
+
+  stamp->exists = true;
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtim;
+}
+
+static bool
+charclass_stamp_equal(const struct charclass_stamp *a, const struct charclass_stamp *b)
+{
+  return a->exists == b->exists && a->dev == b->dev && a->ino == b->ino &&
+         a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+         a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/* Compile defaults + charclass.conf and install the result */
+static void
+charclass_load(void)
+{
+  __typeof__(char_attrs[0]) table[256];
+  char path[512], line[512];
+  unsigned int lineno = 0, rules = 0;
+
+  memcpy(table, charclass_defaults, sizeof(table));
+  charclass_path(path, sizeof(path));
+
+  /* Stamped before reading, so an edit during the read is seen next
+   * time; and even when the file is rejected, so one bad save gives one
+   * notice rather than one per check */
+  charclass_stat(path, &charclass_loaded);
+
+  FILE *file = fopen(path, "r");
+  if (file)
+  {
+    while (fgets(line, sizeof(line), file))
+    {
+      ++lineno;
+      line[strcspn(line, "\r\n")] = '\0';
+
+      const char *p = line + strspn(line, " \t");
+      if (*p == '\0' || *p == '#')
+        continue;
+
+      const char *error = charclass_parse_line(line, table);
+      if (error)
+      {
+        sendto_clients(UMODE_SERVNOTICE, SEND_RECIPIENT_OPER_ALL, SEND_TYPE_NOTICE,
+                       "%s:%u: %s; character classes unchanged", path, lineno, error);
+        fclose(file);
+        return;
+      }
+
+      ++rules;
+    }
+
+    fclose(file);
+  }
+
+  /* A single copy: the core never sees a half-built table */
+  memcpy(char_attrs, table, sizeof(table));
+  match_simd_init();
+
+  if (rules)
+    sendto_clients(UMODE_SERVNOTICE, SEND_RECIPIENT_OPER_ALL, SEND_TYPE_NOTICE,
+                   "Loaded %u character class rules from %s", rules, path);
+}
+
+
+/* ----------------------------------------------------------------
+ * Reload triggers: a plain REHASH (no DNS/MOTD argument) rereads
+ * charclass.conf at once; the check event catches every other path
+ * (SIGHUP, a rehash from another module) and a moved ircd.conf
+ * ---------------------------------------------------------------- */
+
+static void
+mo_rehash_charclass(struct Client *source, int parc, char *parv[])
+{
+  rehash_handler(source, parc, parv);
+
+  if (parc < 2 || string_is_empty(parv[1]))
+    charclass_load();
+}
+
+static void
+charclass_check(void *unused)
+{
+  struct charclass_stamp now;
+  char path[512];
+
+  charclass_path(path, sizeof(path));
+  charclass_stat(path, &now);
+
+  if (!charclass_stamp_equal(&now, &charclass_loaded))
+    charclass_load();
+}
+
+static struct event charclass_check_event =
+{
+  .name = "charclass_check",
+  .handler = charclass_check,
+  .when = CHARCLASS_CHECK
+};
+
+
+/* ----------------------------------------------------------------
+ * Module init / exit
+ * ---------------------------------------------------------------- */
+
+static void
+init_handler(void)
+{
+  memcpy(charclass_defaults, char_attrs, sizeof(charclass_defaults));
+  charclass_load();
+
+  rehash_cmd = command_find("REHASH");
+  if (rehash_cmd)
+  {
+    rehash_handler = rehash_cmd->handlers[OPER_HANDLER].handler;
+    rehash_cmd->handlers[OPER_HANDLER].handler = mo_rehash_charclass;
+  }
+
+  event_add(&charclass_check_event, NULL);
+}
+
+static void
+exit_handler(void)
+{
+  event_delete(&charclass_check_event);
+
+  if (rehash_cmd)
+    rehash_cmd->handlers[OPER_HANDLER].handler = rehash_handler;
+
+  memcpy(char_attrs, charclass_defaults, sizeof(charclass_defaults));
+  match_simd_init();
+}
+
+struct Module module_entry =
+{
+  .init_handler = init_handler,
+  .exit_handler = exit_handler,
+};
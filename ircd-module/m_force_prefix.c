@@ -0,0 +1,304 @@
+/*
+ *  m_force_prefix.c - Force ~ prefix on unauthenticated nicknames at
+ *  registration for ircd-hybrid 8.2.x
+ *
+ *  Does on the ircd what ns_force_prefix does in Anope, but before the
+ *  user is introduced to the network: a client that registers without
+ *  having logged in through SASL gets "~nick" immediately, so no SVSNICK
+ *  and no network-wide NICK change is needed.  Services only have to
+ *  step in when ~nick is already taken or not a valid nickname.
+ *
+ *  Registered nicks are left alone, as ns_force_prefix does: their
+ *  owners may still IDENTIFY, and nick protection is services' job.
+ *  ns_force_prefix pushes the registered set with ENCAP * REGNICK;
+ *  until the push is complete (services not linked yet, or this module
+ *  just loaded) nobody is prefixed here and services do all of it.
+ *  The same goes from the moment services split until they push again.
+ *
+ *  Requires '~' to be a valid nick character (charclass.conf, m_charclass).
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "stdinc.h"
+#include "module.h"
+#include "client.h"
+#include "conf.h"
+#include "hash.h"
+#include "ircd.h"
+#include "ircd_hook.h"
+#include "match.h"
+#include "memory.h"
+#include "parse.h"
+#include "send.h"
+#include "user.h"
+#include "io_string.h"
+
+
+/* Must match PREFIX_CHAR in ns_force_prefix.cpp */
+#define FORCE_PREFIX_CHAR '~'
+
+/* Registered nicks from services, chained by casefolded hash */
+#define FORCE_PREFIX_BUCKETS 65536  /* Power of two */
+
+struct force_prefix_nick
+{
+  struct force_prefix_nick *next;
+  char nick[NICKLEN + 1];
+};
+
+static struct force_prefix_nick *force_prefix_nicks[FORCE_PREFIX_BUCKETS];
+
+/* True once services have sent the full set (REGNICK CLEAR, ADD..., END) */
+static bool force_prefix_synced;
+
+/* SID of the server that sent it */
+static char force_prefix_sid[IRC_MAXSID + 1];
+
+
+/* ----------------------------------------------------------------
+ * Registered nick set
+ * ---------------------------------------------------------------- */
+
+static unsigned int
+force_prefix_hash(const char *nick)
+{
+  uint32_t h = 2166136261u;  /* FNV-1a over the casefolded nick */
+
+  for (; *nick; ++nick)
+    h = (h ^ (unsigned char)ToLower(*nick)) * 16777619u;
+  return h & (FORCE_PREFIX_BUCKETS - 1);
+}
+
+static bool
+force_prefix_registered(const char *nick)
+{
+  for (const struct force_prefix_nick *n = force_prefix_nicks[force_prefix_hash(nick)]; n; n = n->next)
+    if (irccmp(n->nick, nick) == 0)
+      return true;
+  return false;
+}
+
+static void
+force_prefix_add(const char *nick)
+{
+  if (strlen(nick) > NICKLEN || force_prefix_registered(nick))
+    return;
+
+  const unsigned int bucket = force_prefix_hash(nick);
+  struct force_prefix_nick *n = io_calloc(sizeof(*n));
+
+  strlcpy(n->nick, nick, sizeof(n->nick));
+  n->next = force_prefix_nicks[bucket];
+  force_prefix_nicks[bucket] = n;
+}
+
+static void
+force_prefix_del(const char *nick)
+{
+  for (struct force_prefix_nick **link = &force_prefix_nicks[force_prefix_hash(nick)]; *link; link = &(*link)->next)
+  {
+    if (irccmp((*link)->nick, nick) == 0)
+    {
+      struct force_prefix_nick *n = *link;
+      *link = n->next;
+      io_free(n);
+      return;
+    }
+  }
+}
+
+static void
+force_prefix_clear(void)
+{
+  for (unsigned int i = 0; i < FORCE_PREFIX_BUCKETS; ++i)
+  {
+    while (force_prefix_nicks[i])
+    {
+      struct force_prefix_nick *n = force_prefix_nicks[i];
+      force_prefix_nicks[i] = n->next;
+      io_free(n);
+    }
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * REGNICK ENCAP handler — registered nicks from ns_force_prefix
+ *
+ * After ENCAP dispatch:
+ *   parv[0] = "REGNICK"
+ *   parv[1] = CLEAR (full push follows), ADD, DEL or END (push complete)
+ *   parv[2] = space-separated nicks (ADD, DEL)
+ * ---------------------------------------------------------------- */
+
+static void
+me_regnick(struct Client *source, int parc, char *parv[])
+{
+  if (!HasFlag(source, FLAGS_SERVICE) && !IsServer(source))
+    return;
+
+  if (strcmp(parv[1], "CLEAR") == 0)
+  {
+    const struct Client *server = IsServer(source) ? source : source->servptr;
+
+    force_prefix_clear();
+    force_prefix_synced = false;
+    strlcpy(force_prefix_sid, server->id, sizeof(force_prefix_sid));
+    return;
+  }
+
+  if (strcmp(parv[1], "END") == 0)
+  {
+    force_prefix_synced = true;
+    return;
+  }
+
+  if (parc < 3)
+    return;
+
+  const bool add = strcmp(parv[1], "ADD") == 0;
+  if (!add && strcmp(parv[1], "DEL") != 0)
+    return;
+
+  char *save = NULL;
+  for (char *nick = strtok_r(parv[2], " ", &save); nick; nick = strtok_r(NULL, " ", &save))
+  {
+    if (add)
+      force_prefix_add(nick);
+    else
+      force_prefix_del(nick);
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * Hook: prefix the nick of a local client that is about to be
+ * introduced without an account
+ * ---------------------------------------------------------------- */
+
+static hook_flow_t
+force_prefix_register_hook(void *data)
+{
+  const ircd_hook_user_register_ctx *ctx = data;
+  struct Client *client = ctx->client;
+
+  /* Logged in through SASL (m_sasl sets account before registration) */
+  if (client->account[0] != '\0' && strcmp(client->account, "*") != 0)
+    return HOOK_FLOW_CONTINUE;
+
+  /* Already prefixed */
+  if (client->name[0] == FORCE_PREFIX_CHAR)
+    return HOOK_FLOW_CONTINUE;
+
+  /* Without the registered set we cannot tell; leave it to services */
+  if (!force_prefix_synced)
+    return HOOK_FLOW_CONTINUE;
+
+  /* Registered: the owner may still identify */
+  if (force_prefix_registered(client->name))
+    return HOOK_FLOW_CONTINUE;
+
+  /* Build ~nick, truncated to the configured nick length */
+  char newnick[NICKLEN + 1];
+  size_t maxlen = ConfigServerInfo.max_nick_length;
+
+  if (maxlen == 0 || maxlen > NICKLEN)
+    maxlen = NICKLEN;
+
+  newnick[0] = FORCE_PREFIX_CHAR;
+  strlcpy(newnick + 1, client->name, maxlen);
+
+  /* Invalid, registered itself or taken: leave it to services */
+  if (!valid_nickname(newnick, true))
+    return HOOK_FLOW_CONTINUE;
+
+  if (force_prefix_registered(newnick))
+    return HOOK_FLOW_CONTINUE;
+
+  if (hash_find_client(newnick))
+    return HOOK_FLOW_CONTINUE;
+
+  /* Nobody but the client itself has seen the old nick yet */
+  sendto_one(client, ":%s!%s@%s NICK :%s",
+             client->name, client->username, client->host, newnick);
+
+  hash_del_client(client);
+  strlcpy(client->name, newnick, sizeof(client->name));
+  hash_add_client(client);
+
+  return HOOK_FLOW_CONTINUE;
+}
+
+
+/* ----------------------------------------------------------------
+ * Hook: a remote server exits.  If it is services, registrations and
+ * drops made while they are away never reach us, so the set goes stale;
+ * stop prefixing until they link again and push it in full.
+ * ---------------------------------------------------------------- */
+
+static hook_flow_t
+force_prefix_remote_exit_hook(void *data)
+{
+  const ircd_hook_client_exit_ctx *ctx = data;
+  const struct Client *client = ctx->client;
+
+  if (!IsServer(client) || force_prefix_sid[0] == '\0' || strcmp(client->id, force_prefix_sid) != 0)
+    return HOOK_FLOW_CONTINUE;
+
+  force_prefix_clear();
+  force_prefix_synced = false;
+  force_prefix_sid[0] = '\0';
+
+  return HOOK_FLOW_CONTINUE;
+}
+
+
+/* ----------------------------------------------------------------
+ * Command table
+ * ---------------------------------------------------------------- */
+
+static struct Command regnick_cmd =
+{
+  .name = "REGNICK",
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_ignore },
+  .handlers[CLIENT_HANDLER] = { .handler = m_ignore },
+  .handlers[SERVER_HANDLER] = { .handler = m_ignore },
+  .handlers[ENCAP_HANDLER] = { .handler = me_regnick, .args_min = 2 },
+  .handlers[OPER_HANDLER] = { .handler = m_ignore },
+};
+
+
+/* ----------------------------------------------------------------
+ * Module init / exit
+ * ---------------------------------------------------------------- */
+
+static void
+init_handler(void)
+{
+  command_add(&regnick_cmd);
+  hook_install(ircd_hook_user_register_local, force_prefix_register_hook, HOOK_PRIORITY_DEFAULT);
+  hook_install(ircd_hook_client_exit_remote, force_prefix_remote_exit_hook, HOOK_PRIORITY_DEFAULT);
+}
+
+static void
+exit_handler(void)
+{
+  command_del(&regnick_cmd);
+  hook_uninstall(ircd_hook_user_register_local, force_prefix_register_hook);
+  hook_uninstall(ircd_hook_client_exit_remote, force_prefix_remote_exit_hook);
+  force_prefix_clear();
+  force_prefix_synced = false;
+  force_prefix_sid[0] = '\0';
+}
+
+struct Module module_entry =
+{
+  .init_handler = init_handler,
+  .exit_handler = exit_handler,
+};
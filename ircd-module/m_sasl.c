@@ -20,71 +20,1387 @@
 #include "id.h"
 #include "ircd.h"
 #include "ircd_hook.h"
+#include "match.h"
 #include "numeric.h"
 #include "parse.h"
 #include "send.h"
+#include "user.h"
+#include "conf.h"
+#include "hostmask.h"
+#include "event.h"
+#include "memory.h"
 #include "io_string.h"
 #include "io_time.h"
 
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
 
 /* SASL capability flag - next available bit after CAP_STANDARD_REPLIES (1 << 8) */
 #define CAP_SASL (1 << 9)
 
-/* Limits */
-#define SASL_MAX_SESSIONS  256
-#define SASL_MAX_MESSAGES   20
-#define SASL_MAX_FAILURES    3
+/* Limits */
+#define SASL_MAX_SESSIONS  256
+#define SASL_MAX_MESSAGES   20
+#define SASL_MAX_FAILURES    3
+
+/*
+ * AUTHENTICATE flood budget, per client and separate from the core's
+ * flood control: token buckets of lines and of bytes, refilled
+ * continuously.  Every line is charged, mechanism selection and abort
+ * included, so starting over does not refill it.  The burst covers a
+ * response split over several 400-byte lines; a sustained flood runs
+ * dry and is refused before any of it is relayed to services.
+ * Fixed size and keyed by client, dropped when the client exits; when
+ * full, the entry with the most tokens left is reused, which at worst
+ * hands its client a fresh burst.
+ */
+#define SASL_FLOOD_LINES          8  /* Burst */
+#define SASL_FLOOD_LINES_RATE     2  /* Refill per second */
+#define SASL_FLOOD_BYTES       4096  /* Burst */
+#define SASL_FLOOD_BYTES_RATE   800  /* Refill per second */
+#define SASL_FLOOD_SIZE        1024  /* Power of two */
+#define SASL_FLOOD_PROBE          8
+
+struct sasl_flood
+{
+  const struct Client *client;  /* NULL = free slot */
+  uint64_t lines;               /* Line tokens left, in 1/1000 lines */
+  uint64_t bytes;               /* Byte tokens left, in 1/1000 bytes */
+  uintmax_t stamp;              /* Monotonic msec of the last refill */
+};
+
+static struct sasl_flood sasl_floods[SASL_FLOOD_SIZE];
+
+/*
+ * An unregistered client with a session in progress is not registered
+ * on CAP END; it is introduced once the exchange ends, already logged
+ * in.  Sessions older than SASL_HOLD_TIMEOUT seconds are aborted, held
+ * or not, so a stalled exchange never keeps its slot.
+ */
+#define REG_NEED_SASL  0x8  /* Next bit after REG_NEED_CAP */
+#ifndef SASL_HOLD_TIMEOUT
+#define SASL_HOLD_TIMEOUT 15
+#endif
+
+/*
+ * Mechanisms whose first server challenge is always empty.  For these
+ * the module answers "AUTHENTICATE +" itself instead of waiting for
+ * services' "C +", saving one ircd->services->ircd round trip.
+ */
+static const char *const sasl_empty_challenge[] = { "PLAIN", "EXTERNAL", NULL };
+
+/*
+ * PASS account:password from a client that does not use SASL is
+ * turned into a PLAIN session of our own, run before registration like
+ * any other, so legacy clients are introduced already logged in
+ * instead of identifying (and being renamed) afterwards.
+ *
+ * Off until services send ENCAP * SASLPASS ON.  PASS itself only holds
+ * registration; the decision is made once NICK, USER and CAP are done.
+ * A client that requested CAP sasl, or whose PASS is the password of
+ * its auth {} block, registers normally and services never see it.
+ */
+static bool sasl_pass_enabled;
+
+/* Core unregistered handlers wrapped for it */
+enum { SASL_WRAP_PASS, SASL_WRAP_NICK, SASL_WRAP_USER, SASL_WRAP_CAP, SASL_WRAP_COUNT };
+
+static struct
+{
+  const char *name;
+  struct Command *cmd;
+  void (*handler)(struct Client *, int, char *[]);
+} sasl_wraps[SASL_WRAP_COUNT] =
+{
+  [SASL_WRAP_PASS] = { .name = "PASS" },
+  [SASL_WRAP_NICK] = { .name = "NICK" },
+  [SASL_WRAP_USER] = { .name = "USER" },
+  [SASL_WRAP_CAP] = { .name = "CAP" },
+};
+
+/*
+ * Resumption tokens: "account:generation:expiry:hmac", hmac being hex
+ * HMAC-SHA256("account:generation:expiry") under a key services push
+ * with ENCAP * SASLKEY.  Handed out after every successful login as
+ * NOTE AUTHENTICATE RESUME_TOKEN, accepted back through the X-RESUME
+ * mechanism and verified here without asking services.
+ *
+ * The generation is per account and pushed with ENCAP * SASLGEN.
+ * Services move it on password change and suspension and forget it on
+ * drop, so a token is only good while its generation is the account's
+ * current one; accounts we hold no generation for get no tokens.
+ */
+#define SASL_RESUME_MECH    "X-RESUME"
+#define SASL_RESUME_KEYLEN  64
+#ifndef SASL_RESUME_TTL
+#define SASL_RESUME_TTL     86400  /* Seconds a token stays valid */
+#endif
+#define SASL_TOKENLEN       (ACCOUNTLEN + 1 + 20 + 1 + 20 + 1 + 64)
+#define SASL_GEN_BUCKETS    16384  /* Power of two */
+
+struct sasl_gen
+{
+  struct sasl_gen *next;
+  char account[ACCOUNTLEN + 1];
+  uintmax_t generation;
+};
+
+static unsigned char resume_key[SASL_RESUME_KEYLEN];
+static size_t resume_keylen;  /* 0 = no key from services, X-RESUME disabled */
+static struct sasl_gen *sasl_gens[SASL_GEN_BUCKETS];
+
+/*
+ * Certificate fingerprint -> account, pushed by services with
+ * ENCAP * SASLCERT.  EXTERNAL for a client whose certfp is in here is
+ * finished locally; a miss falls through to the services relay.
+ */
+#define SASL_CERT_BUCKETS  4096  /* Power of two */
+#define SASL_CERTFPLEN      128
+
+struct sasl_cert
+{
+  struct sasl_cert *next;
+  char certfp[SASL_CERTFPLEN + 1];
+  char account[ACCOUNTLEN + 1];
+};
+
+static struct sasl_cert *sasl_certs[SASL_CERT_BUCKETS];
+
+/*
+ * Failure throttling per source network (IPv4 /24, IPv6 /64), across
+ * connections.  Each failure adds SASL_THROTTLE_UNIT to a score that
+ * halves every SASL_THROTTLE_HALFLIFE seconds; crossing the threshold
+ * blocks new sessions for SASL_THROTTLE_BLOCK << strikes seconds.
+ * Fixed size: when full, the entry with the lowest score is reused.
+ */
+#define SASL_THROTTLE_SIZE      4096  /* Power of two */
+#define SASL_THROTTLE_PROBE        8
+#define SASL_THROTTLE_UNIT        16
+#define SASL_THROTTLE_LIMIT       (10 * SASL_THROTTLE_UNIT)
+#define SASL_THROTTLE_HALFLIFE    60
+#define SASL_THROTTLE_BLOCK        2
+#define SASL_THROTTLE_MAXBLOCK   600
+
+struct sasl_throttle
+{
+  unsigned char prefix[8];   /* First 3 (v4) or 8 (v6) address bytes */
+  unsigned char family;      /* 0 = free slot */
+  unsigned char strikes;     /* Blocks so far, doubles the next one */
+  unsigned int score;
+  uintmax_t stamp;           /* Last decay */
+  uintmax_t blocked_until;
+};
+
+static struct sasl_throttle sasl_throttles[SASL_THROTTLE_SIZE];
+
+/*
+ * Recently failing PLAIN authcids, as a counting Bloom filter: k = 3
+ * saturating byte counters per name, all halved every
+ * SASL_AUTHCID_HALFLIFE seconds.  A name whose counters all reach
+ * SASL_AUTHCID_LIMIT is refused locally.  Fixed size no matter how many
+ * names are tried; a false positive only costs a retry later.
+ */
+#define SASL_AUTHCID_COUNTERS  65536  /* Power of two, multiple of 8 */
+#define SASL_AUTHCID_HASHES        3
+#define SASL_AUTHCID_LIMIT         8
+#define SASL_AUTHCID_HALFLIFE     60
+
+static unsigned char sasl_authcids[SASL_AUTHCID_COUNTERS];
+
+/*
+ * Slow-login log.  Each session keeps a short trace of phase times
+ * (services C, client C, D) relative to its start; exchanges that take
+ * SASL_SLOW_MS or longer are queued in a ring and written to
+ * SASL_SLOW_LOG by a once-a-second event, at most SASL_SLOW_PER_TICK
+ * lines per run.  A full ring drops entries and counts them.
+ */
+#ifndef SASL_SLOW_MS
+#define SASL_SLOW_MS        2000
+#endif
+#ifndef SASL_SLOW_LOG
+#define SASL_SLOW_LOG       "var/log/sasl-slow.log"  /* Relative to the ircd prefix */
+#endif
+#define SASL_SLOW_RING        64
+#define SASL_SLOW_PER_TICK    10
+#define SASL_TRACE_LEN         8
+
+struct sasl_phase
+{
+  char what;                     /* c = services C, C = client C, D = done */
+  uint32_t ms;                   /* Since the exchange started */
+};
+
+struct sasl_slow
+{
+  uintmax_t when;                /* Realtime, seconds */
+  char uid[IDLEN + 1];
+  char ip[HOSTIPLEN + 1];
+  char authcid[ACCOUNTLEN + 1];
+  char result;
+  unsigned int phases;
+  struct sasl_phase trace[SASL_TRACE_LEN];
+};
+
+static struct sasl_slow sasl_slow_ring[SASL_SLOW_RING];
+static unsigned int sasl_slow_head, sasl_slow_count, sasl_slow_dropped;
+
+/*
+ * Oper notices: events are only counted here, and one summary per
+ * SASL_STATS_WINDOW seconds goes out from a timer, however busy it got.
+ * Failing networks (/24, /64) are estimated by linear counting over a
+ * small bitmap; services response times go into log2 buckets for p99.
+ */
+#define SASL_STATS_WINDOW      10
+#define SASL_STATS_NETBITS   1024
+#define SASL_STATS_BUCKETS     16  /* [i]: answered in under 2^i ms */
+
+static struct
+{
+  unsigned int started;
+  unsigned int succeeded;
+  unsigned int failed;
+  unsigned int refused;          /* Stopped here by the throttles */
+  unsigned int timedout;
+  uint32_t nets[SASL_STATS_NETBITS / 32];
+  unsigned int latency[SASL_STATS_BUCKETS];
+  unsigned int samples;
+} sasl_stats;
+
+/* SID of the server SASL agents last answered from */
+static char sasl_services_sid[IRC_MAXSID + 1];
+
+/* Mechanisms last announced by services, local ones are appended */
+static char sasl_mechs[256] = "PLAIN";
+
+/*
+ * SASL session state — tracks each in-progress SASL negotiation.
+ * Sessions are keyed by client pointer and cleaned up on client exit.
+ */
+struct sasl_session
+{
+  struct Client *client;         /* The local client performing SASL */
+  char agent[IDLEN + 1];        /* UID of the services agent handling this session */
+  unsigned int messages;         /* Number of AUTHENTICATE messages received */
+  unsigned int failures;         /* Number of failed authentication attempts */
+  uintmax_t start_time;         /* Monotonic time when session started */
+  uintmax_t start_ms;           /* Monotonic msec when the current exchange started */
+  unsigned int phases;           /* Entries used in trace */
+  struct sasl_phase trace[SASL_TRACE_LEN];
+  bool complete;                 /* True once D (done) received from services */
+  bool speculative;              /* AUTHENTICATE + sent locally, services' C + still due */
+  bool resume;                   /* X-RESUME: handled here, services not involved */
+  char external[ACCOUNTLEN + 1]; /* EXTERNAL answered from sasl_certs for this account */
+  bool plain;                    /* PLAIN, credentials not seen yet */
+  char authcid[ACCOUNTLEN + 1];  /* Casefolded PLAIN authcid, for sasl_authcids */
+  bool pass;                     /* Started from PASS account:password, not by the client */
+};
+
+static struct sasl_session sessions[SASL_MAX_SESSIONS];
+
+
+/* ----------------------------------------------------------------
+ * Session management helpers
+ * ---------------------------------------------------------------- */
+
+static struct sasl_session *
+sasl_find_session(const struct Client *client)
+{
+  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+    if (sessions[i].client == client)
+      return &sessions[i];
+  return NULL;
+}
+
+static struct sasl_session *
+sasl_new_session(struct Client *client)
+{
+  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i].client == NULL)
+    {
+      memset(&sessions[i], 0, sizeof(sessions[i]));
+      sessions[i].client = client;
+      sessions[i].start_time = io_time_get(IO_TIME_MONOTONIC_SEC);
+      sessions[i].start_ms = io_time_get(IO_TIME_MONOTONIC_MSEC);
+      return &sessions[i];
+    }
+  }
+  return NULL;
+}
+
+static void
+sasl_clear_session(struct sasl_session *session)
+{
+  memset(session, 0, sizeof(*session));
+}
+
+/* Lift the registration hold; may register (or exit) the client */
+static void
+sasl_release(struct Client *client)
+{
+  if (!(client->connection->registration & REG_NEED_SASL))
+    return;
+
+  client->connection->registration &= ~REG_NEED_SASL;
+  if (client->connection->registration == 0)
+    user_register_local(client);
+}
+
+/*
+ * sasl_release() for callers inside exit_client(), where registering a
+ * client (and maybe exiting it again) is not safe: only the hold is
+ * dropped, and sasl_register_pending() registers it on the next tick.
+ */
+static bool sasl_register_due;
+
+static void
+sasl_release_later(struct Client *client)
+{
+  if (!(client->connection->registration & REG_NEED_SASL))
+    return;
+
+  client->connection->registration &= ~REG_NEED_SASL;
+  if (client->connection->registration == 0)
+    sasl_register_due = true;
+}
+
+static void
+sasl_register_pending(void)
+{
+  if (!sasl_register_due)
+    return;
+
+  sasl_register_due = false;
+
+  dlink_node *node, *node_next;
+  DLINK_FOREACH_SAFE(node, node_next, unknown_list.head)
+  {
+    struct Client *client = node->data;
+
+    /* Nothing else leaves a client unknown with no registration step
+     * left: the core registers it the moment the last one clears */
+    if (IsUnknown(client) && !HasFlag(client, FLAGS_CLOSING) &&
+        client->connection->registration == 0)
+      user_register_local(client);
+  }
+}
+
+/* Clear a session that ended while its client stays connected */
+static void
+sasl_end_session(struct sasl_session *session)
+{
+  struct Client *client = session->client;
+
+  sasl_clear_session(session);
+  sasl_release(client);
+}
+
+static uint32_t
+sasl_flood_hash(const struct Client *client)
+{
+  return ((uintptr_t)client >> 4) * 2654435761u >> 8;
+}
+
+static void
+sasl_flood_refill(struct sasl_flood *entry, uintmax_t now)
+{
+  uint64_t elapsed = now - entry->stamp;
+
+  /* Rates are per second and tokens per 1/1000, so one msec adds rate */
+  if (elapsed > SASL_FLOOD_BYTES * 1000 / SASL_FLOOD_BYTES_RATE)
+    elapsed = SASL_FLOOD_BYTES * 1000 / SASL_FLOOD_BYTES_RATE;
+  entry->stamp = now;
+
+  entry->lines += elapsed * SASL_FLOOD_LINES_RATE;
+  if (entry->lines > SASL_FLOOD_LINES * 1000)
+    entry->lines = SASL_FLOOD_LINES * 1000;
+
+  entry->bytes += elapsed * SASL_FLOOD_BYTES_RATE;
+  if (entry->bytes > SASL_FLOOD_BYTES * 1000)
+    entry->bytes = SASL_FLOOD_BYTES * 1000;
+}
+
+/* Find the client's bucket, claiming a slot for a new one */
+static struct sasl_flood *
+sasl_flood_find(const struct Client *client, bool create, uintmax_t now)
+{
+  const uint32_t h = sasl_flood_hash(client);
+  struct sasl_flood *victim = NULL;
+
+  for (unsigned int i = 0; i < SASL_FLOOD_PROBE; ++i)
+  {
+    struct sasl_flood *entry = &sasl_floods[(h + i) & (SASL_FLOOD_SIZE - 1)];
+
+    if (entry->client == client)
+    {
+      sasl_flood_refill(entry, now);
+      return entry;
+    }
+
+    if (entry->client)
+      sasl_flood_refill(entry, now);
+
+    if (victim == NULL || entry->client == NULL || (victim->client && entry->lines > victim->lines))
+      victim = entry;
+  }
+
+  if (!create)
+    return NULL;
+
+  victim->client = client;
+  victim->lines = SASL_FLOOD_LINES * 1000;
+  victim->bytes = SASL_FLOOD_BYTES * 1000;
+  victim->stamp = now;
+  return victim;
+}
+
+/* Take one line of len bytes from the client's budget; false if it ran dry */
+static bool
+sasl_flood_charge(const struct Client *client, size_t len)
+{
+  struct sasl_flood *entry = sasl_flood_find(client, true, io_time_get(IO_TIME_MONOTONIC_MSEC));
+
+  if (entry->lines < 1000 || entry->bytes < len * 1000)
+    return false;
+
+  entry->lines -= 1000;
+  entry->bytes -= len * 1000;
+  return true;
+}
+
+static void
+sasl_flood_forget(const struct Client *client)
+{
+  struct sasl_flood *entry = sasl_flood_find(client, false, io_time_get(IO_TIME_MONOTONIC_MSEC));
+
+  if (entry)
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Give an unregistered client its UID now, so services can address it */
+static void
+sasl_assign_uid(struct Client *client)
+{
+  if (client->id[0])
+    return;
+
+  const char *id;
+  while (hash_find_id((id = uid_get())))
+    ;
+  strlcpy(client->id, id, sizeof(client->id));
+  hash_add_id(client);
+}
+
+static bool
+sasl_starts_empty(const char *mech)
+{
+  for (const char *const *m = sasl_empty_challenge; *m; ++m)
+    if (strcasecmp(*m, mech) == 0)
+      return true;
+  return false;
+}
+
+
+/* ----------------------------------------------------------------
+ * Base64 (AUTHENTICATE payloads)
+ * ---------------------------------------------------------------- */
+
+static int
+sasl_base64_value(int c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+/* Decode base64 into out (NUL terminated); -1 if malformed or too long */
+static int
+sasl_base64_decode(const char *in, char *out, size_t size)
+{
+  size_t len = 0;
+  unsigned int bits = 0, nbits = 0;
+
+  for (; *in && *in != '='; ++in)
+  {
+    int v = sasl_base64_value(*in);
+    if (v < 0)
+      return -1;
+
+    bits = bits << 6 | v;
+    nbits += 6;
+
+    if (nbits >= 8)
+    {
+      nbits -= 8;
+      if (len + 1 >= size)
+        return -1;
+      out[len++] = (bits >> nbits) & 0xFF;
+    }
+  }
+
+  out[len] = '\0';
+  return len;
+}
+
+/* Encode len bytes into out (NUL terminated); -1 if it does not fit */
+static int
+sasl_base64_encode(const unsigned char *in, size_t len, char *out, size_t size)
+{
+  static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t pos = 0;
+
+  if ((len + 2) / 3 * 4 >= size)
+    return -1;
+
+  for (size_t i = 0; i < len; i += 3)
+  {
+    const uint32_t n = (uint32_t)in[i] << 16 |
+                       (i + 1 < len ? (uint32_t)in[i + 1] << 8 : 0) |
+                       (i + 2 < len ? in[i + 2] : 0);
+
+    out[pos++] = alphabet[n >> 18 & 63];
+    out[pos++] = alphabet[n >> 12 & 63];
+    out[pos++] = i + 1 < len ? alphabet[n >> 6 & 63] : '=';
+    out[pos++] = i + 2 < len ? alphabet[n & 63] : '=';
+  }
+
+  out[pos] = '\0';
+  return pos;
+}
+
+
+/* ----------------------------------------------------------------
+ * Certificate fingerprint cache
+ * ---------------------------------------------------------------- */
+
+static unsigned int
+sasl_cert_hash(const char *certfp)
+{
+  uint32_t h = 2166136261u;  /* FNV-1a, fingerprints are case-insensitive hex */
+
+  for (; *certfp; ++certfp)
+    h = (h ^ (unsigned char)ToLower(*certfp)) * 16777619u;
+  return h & (SASL_CERT_BUCKETS - 1);
+}
+
+static struct sasl_cert *
+sasl_cert_find(const char *certfp)
+{
+  for (struct sasl_cert *cert = sasl_certs[sasl_cert_hash(certfp)]; cert; cert = cert->next)
+    if (strcasecmp(cert->certfp, certfp) == 0)
+      return cert;
+  return NULL;
+}
+
+static void
+sasl_cert_add(const char *certfp, const char *account)
+{
+  if (strlen(certfp) > SASL_CERTFPLEN)
+    return;
+
+  struct sasl_cert *cert = sasl_cert_find(certfp);
+  if (cert == NULL)
+  {
+    unsigned int bucket = sasl_cert_hash(certfp);
+
+    cert = io_calloc(sizeof(*cert));
+    strlcpy(cert->certfp, certfp, sizeof(cert->certfp));
+    cert->next = sasl_certs[bucket];
+    sasl_certs[bucket] = cert;
+  }
+
+  strlcpy(cert->account, account, sizeof(cert->account));
+}
+
+/* Remove entries matching certfp, or all of account's if certfp is NULL */
+static void
+sasl_cert_del(const char *certfp, const char *account)
+{
+  unsigned int first = 0, last = SASL_CERT_BUCKETS - 1;
+
+  if (certfp)
+    first = last = sasl_cert_hash(certfp);
+
+  for (unsigned int i = first; i <= last; ++i)
+  {
+    for (struct sasl_cert **link = &sasl_certs[i]; *link; )
+    {
+      struct sasl_cert *cert = *link;
+
+      if (certfp ? strcasecmp(cert->certfp, certfp) == 0 : irccmp(cert->account, account) == 0)
+      {
+        *link = cert->next;
+        io_free(cert);
+      }
+      else
+        link = &cert->next;
+    }
+  }
+}
+
+static void
+sasl_cert_clear(void)
+{
+  for (unsigned int i = 0; i < SASL_CERT_BUCKETS; ++i)
+  {
+    while (sasl_certs[i])
+    {
+      struct sasl_cert *cert = sasl_certs[i];
+      sasl_certs[i] = cert->next;
+      io_free(cert);
+    }
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * Resumption token generations
+ * ---------------------------------------------------------------- */
+
+static unsigned int
+sasl_gen_hash(const char *account)
+{
+  uint32_t h = 2166136261u;  /* FNV-1a over the casemapped name */
+
+  for (; *account; ++account)
+    h = (h ^ (unsigned char)ToLower(*account)) * 16777619u;
+  return h & (SASL_GEN_BUCKETS - 1);
+}
+
+static struct sasl_gen *
+sasl_gen_find(const char *account)
+{
+  for (struct sasl_gen *gen = sasl_gens[sasl_gen_hash(account)]; gen; gen = gen->next)
+    if (irccmp(gen->account, account) == 0)
+      return gen;
+  return NULL;
+}
+
+static void
+sasl_gen_set(const char *account, uintmax_t generation)
+{
+  if (strlen(account) > ACCOUNTLEN)
+    return;
+
+  struct sasl_gen *gen = sasl_gen_find(account);
+  if (gen == NULL)
+  {
+    unsigned int bucket = sasl_gen_hash(account);
+
+    gen = io_calloc(sizeof(*gen));
+    strlcpy(gen->account, account, sizeof(gen->account));
+    gen->next = sasl_gens[bucket];
+    sasl_gens[bucket] = gen;
+  }
+
+  gen->generation = generation;
+}
+
+static void
+sasl_gen_del(const char *account)
+{
+  for (struct sasl_gen **link = &sasl_gens[sasl_gen_hash(account)]; *link; link = &(*link)->next)
+  {
+    struct sasl_gen *gen = *link;
+
+    if (irccmp(gen->account, account) == 0)
+    {
+      *link = gen->next;
+      io_free(gen);
+      return;
+    }
+  }
+}
+
+static void
+sasl_gen_clear(void)
+{
+  for (unsigned int i = 0; i < SASL_GEN_BUCKETS; ++i)
+  {
+    while (sasl_gens[i])
+    {
+      struct sasl_gen *gen = sasl_gens[i];
+      sasl_gens[i] = gen->next;
+      io_free(gen);
+    }
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * Per-network failure throttling
+ * ---------------------------------------------------------------- */
+
+/* Loopback is exempt from the throttle and the authcid filter: local
+ * gateways, and bench/ load runs */
+static bool
+sasl_exempt(const struct Client *client)
+{
+  return strncmp(client->sockhost, "127.", 4) == 0 || strcmp(client->sockhost, "::1") == 0;
+}
+
+/* Network prefix of a client address; false if exempt or unparsable */
+static bool
+sasl_throttle_key(const struct Client *client, unsigned char prefix[8], unsigned char *family)
+{
+  unsigned char addr[16];
+
+  memset(prefix, 0, 8);
+
+  if (sasl_exempt(client))
+    return false;
+
+  if (inet_pton(AF_INET, client->sockhost, addr) == 1)
+  {
+    memcpy(prefix, addr, 3);
+    *family = AF_INET;
+    return true;
+  }
+
+  if (inet_pton(AF_INET6, client->sockhost, addr) == 1)
+  {
+    memcpy(prefix, addr, 8);
+    *family = AF_INET6;
+    return true;
+  }
+
+  return false;
+}
+
+/* FNV-1a with a final mix: prefixes end in zero bytes, which FNV alone
+ * leaves poorly spread over the low bits */
+static uint32_t
+sasl_throttle_hash(const unsigned char prefix[8], unsigned char family)
+{
+  uint32_t h = 2166136261u;
+
+  for (unsigned int i = 0; i < 8; ++i)
+    h = (h ^ prefix[i]) * 16777619u;
+  h = (h ^ family) * 16777619u;
+
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  return h ^ (h >> 16);
+}
+
+static void
+sasl_throttle_decay(struct sasl_throttle *entry, uintmax_t now)
+{
+  const uintmax_t halvings = (now - entry->stamp) / SASL_THROTTLE_HALFLIFE;
+
+  if (halvings == 0)
+    return;
+
+  entry->score = halvings >= 32 ? 0 : entry->score >> halvings;
+  entry->stamp += halvings * SASL_THROTTLE_HALFLIFE;
+
+  /* Quiet long enough that the block history is forgotten too */
+  if (entry->score == 0 && entry->blocked_until < now)
+    entry->strikes = 0;
+}
+
+/* Find the entry for a client's network, optionally claiming a slot */
+static struct sasl_throttle *
+sasl_throttle_find(const struct Client *client, bool create, uintmax_t now)
+{
+  unsigned char prefix[8], family;
+
+  if (!sasl_throttle_key(client, prefix, &family))
+    return NULL;
+
+  const uint32_t h = sasl_throttle_hash(prefix, family);
+  struct sasl_throttle *victim = NULL;
+
+  for (unsigned int i = 0; i < SASL_THROTTLE_PROBE; ++i)
+  {
+    struct sasl_throttle *entry = &sasl_throttles[(h + i) & (SASL_THROTTLE_SIZE - 1)];
+
+    if (entry->family == family && memcmp(entry->prefix, prefix, sizeof(prefix)) == 0)
+    {
+      sasl_throttle_decay(entry, now);
+      return entry;
+    }
+
+    if (entry->family)
+    {
+      sasl_throttle_decay(entry, now);
+      if (entry->blocked_until >= now)
+        continue;  /* Never evict an active block */
+    }
+
+    if (victim == NULL || entry->family == 0 || (victim->family && entry->score < victim->score))
+      victim = entry;
+  }
+
+  if (!create || victim == NULL)
+    return NULL;
+
+  memset(victim, 0, sizeof(*victim));
+  memcpy(victim->prefix, prefix, sizeof(prefix));
+  victim->family = family;
+  victim->stamp = now;
+  return victim;
+}
+
+/* Seconds left on a block for this client's network, 0 if none */
+static uintmax_t
+sasl_throttle_blocked(const struct Client *client)
+{
+  const uintmax_t now = io_time_get(IO_TIME_MONOTONIC_SEC);
+  const struct sasl_throttle *entry = sasl_throttle_find(client, false, now);
+
+  if (entry && entry->blocked_until > now)
+    return entry->blocked_until - now;
+  return 0;
+}
+
+static void
+sasl_throttle_failure(const struct Client *client)
+{
+  const uintmax_t now = io_time_get(IO_TIME_MONOTONIC_SEC);
+  struct sasl_throttle *entry = sasl_throttle_find(client, true, now);
+
+  if (entry == NULL)
+    return;
+
+  entry->score += SASL_THROTTLE_UNIT;
+
+  if (entry->score >= SASL_THROTTLE_LIMIT && entry->blocked_until <= now)
+  {
+    uintmax_t block = SASL_THROTTLE_MAXBLOCK;
+
+    if (entry->strikes < 16)
+      block = (uintmax_t)SASL_THROTTLE_BLOCK << entry->strikes;
+    if (block > SASL_THROTTLE_MAXBLOCK)
+      block = SASL_THROTTLE_MAXBLOCK;
+
+    entry->blocked_until = now + block;
+    if (entry->strikes < 16)
+      ++entry->strikes;
+
+    /* Start the next block from half the limit, not from zero */
+    entry->score = SASL_THROTTLE_LIMIT / 2;
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * Failing authcid filter
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_authcid_slots(const char *authcid, unsigned int slot[SASL_AUTHCID_HASHES])
+{
+  uint64_t h = 14695981039346656037ull;  /* FNV-1a 64, split for double hashing */
+
+  for (; *authcid; ++authcid)
+    h = (h ^ (unsigned char)*authcid) * 1099511628211ull;
+
+  const uint32_t h1 = h, h2 = (h >> 32) | 1;
+  for (unsigned int i = 0; i < SASL_AUTHCID_HASHES; ++i)
+    slot[i] = (h1 + i * h2) & (SASL_AUTHCID_COUNTERS - 1);
+}
+
+static bool
+sasl_authcid_blocked(const char *authcid)
+{
+  unsigned int slot[SASL_AUTHCID_HASHES];
+
+  sasl_authcid_slots(authcid, slot);
+  for (unsigned int i = 0; i < SASL_AUTHCID_HASHES; ++i)
+    if (sasl_authcids[slot[i]] < SASL_AUTHCID_LIMIT)
+      return false;
+  return true;
+}
+
+static void
+sasl_authcid_failure(const char *authcid)
+{
+  unsigned int slot[SASL_AUTHCID_HASHES];
+
+  sasl_authcid_slots(authcid, slot);
+  for (unsigned int i = 0; i < SASL_AUTHCID_HASHES; ++i)
+    if (sasl_authcids[slot[i]] < UINT8_MAX)
+      ++sasl_authcids[slot[i]];
+}
+
+/*
+ * Take the authcid out of a PLAIN response (authzid NUL authcid NUL
+ * passwd) and fold it the way account names compare.  Responses split
+ * over several AUTHENTICATE lines are not inspected.
+ */
+static bool
+sasl_plain_authcid(const char *response, char authcid[ACCOUNTLEN + 1])
+{
+  char buf[400];
+  const int len = sasl_base64_decode(response, buf, sizeof(buf));
+
+  if (len <= 0)
+    return false;
+
+  const char *start = memchr(buf, '\0', len);
+  if (start == NULL)
+    return false;
+  ++start;
+
+  const char *end = memchr(start, '\0', buf + len - start);
+  if (end == NULL || end == start || end - start > ACCOUNTLEN)
+    return false;
+
+  for (const char *p = start; p < end; ++p)
+    *authcid++ = ToLower(*p);
+  *authcid = '\0';
+  return true;
+}
+
+/* Event: halve every counter, eight at a time */
+static void
+sasl_authcid_decay(void *unused)
+{
+  for (unsigned int i = 0; i < SASL_AUTHCID_COUNTERS; i += sizeof(uint64_t))
+  {
+    uint64_t word;
+
+    memcpy(&word, sasl_authcids + i, sizeof(word));
+    word = (word >> 1) & 0x7F7F7F7F7F7F7F7Full;
+    memcpy(sasl_authcids + i, &word, sizeof(word));
+  }
+}
+
+static struct event sasl_authcid_event =
+{
+  .name = "sasl_authcid_decay",
+  .handler = sasl_authcid_decay,
+  .when = SASL_AUTHCID_HALFLIFE
+};
+
+
+/* ----------------------------------------------------------------
+ * Oper statistics
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_stats_latency(uint32_t ms)
+{
+  unsigned int bucket = 0;
+
+  while (bucket < SASL_STATS_BUCKETS - 1 && ms >= (1u << bucket))
+    ++bucket;
+
+  ++sasl_stats.latency[bucket];
+  ++sasl_stats.samples;
+}
+
+static void
+sasl_stats_failure(const struct Client *client)
+{
+  unsigned char prefix[8], family;
+
+  ++sasl_stats.failed;
+
+  if (sasl_throttle_key(client, prefix, &family))
+  {
+    const uint32_t h = sasl_throttle_hash(prefix, family) % SASL_STATS_NETBITS;
+    sasl_stats.nets[h / 32] |= 1u << (h % 32);
+  }
+}
+
+/* Natural log for the linear counting estimate, without libm */
+static double
+sasl_stats_ln(double x)
+{
+  double k = 0;
+
+  while (x >= 2)
+  {
+    x /= 2;
+    k += 0.69314718055994531;
+  }
+
+  const double y = (x - 1) / (x + 1), y2 = y * y;
+  return k + 2 * y * (1 + y2 / 3 + y2 * y2 / 5 + y2 * y2 * y2 / 7);
+}
+
+/* Event: one summary for the last window, if anything happened */
+static void
+sasl_stats_report(void *unused)
+{
+  if (sasl_stats.started == 0 && sasl_stats.failed == 0 && sasl_stats.refused == 0)
+    return;
+
+  unsigned int zeros = 0;
+  for (unsigned int i = 0; i < SASL_STATS_NETBITS / 32; ++i)
+    zeros += 32 - __builtin_popcount(sasl_stats.nets[i]);
+
+  unsigned int nets = SASL_STATS_NETBITS;
+  if (zeros)
+    nets = SASL_STATS_NETBITS * sasl_stats_ln((double)SASL_STATS_NETBITS / zeros) + 0.5;
+
+  char p99[32] = "n/a";
+  if (sasl_stats.samples)
+  {
+    unsigned int seen = 0, bucket = 0;
+    const unsigned int want = sasl_stats.samples - sasl_stats.samples / 100;
+
+    while ((seen += sasl_stats.latency[bucket]) < want)
+      ++bucket;
+
+    if (bucket == SASL_STATS_BUCKETS - 1)
+      snprintf(p99, sizeof(p99), ">=%ums", 1u << (bucket - 1));
+    else
+      snprintf(p99, sizeof(p99), "<%ums", 1u << bucket);
+  }
+
+  sendto_clients(UMODE_SERVNOTICE, SEND_RECIPIENT_OPER_ALL, SEND_TYPE_NOTICE,
+                 "SASL last %us: %u started, %u succeeded, %u failed from %s%u networks, "
+                 "%u refused locally, %u timed out, services p99 %s",
+                 SASL_STATS_WINDOW, sasl_stats.started, sasl_stats.succeeded,
+                 sasl_stats.failed, zeros ? "~" : ">=", nets,
+                 sasl_stats.refused, sasl_stats.timedout, p99);
+
+  memset(&sasl_stats, 0, sizeof(sasl_stats));
+}
+
+static struct event sasl_stats_event =
+{
+  .name = "sasl_stats_report",
+  .handler = sasl_stats_report,
+  .when = SASL_STATS_WINDOW
+};
+
+
+/* ----------------------------------------------------------------
+ * Slow-login log
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_phase(struct sasl_session *session, char what)
+{
+  if (session->phases < SASL_TRACE_LEN)
+  {
+    const uint32_t ms = io_time_get(IO_TIME_MONOTONIC_MSEC) - session->start_ms;
+    const struct sasl_phase *prev = session->phases ? &session->trace[session->phases - 1] : NULL;
+
+    /* Services answering the start or a client C: one round trip */
+    if (what != 'C' && (prev == NULL || prev->what == 'C'))
+      sasl_stats_latency(ms - (prev ? prev->ms : 0));
+
+    session->trace[session->phases].what = what;
+    session->trace[session->phases].ms = ms;
+    ++session->phases;
+  }
+}
+
+/* Services answered D: queue the exchange if it was slow, start a new one */
+static void
+sasl_phase_done(struct sasl_session *session, char result)
+{
+  sasl_phase(session, 'D');
+
+  const uintmax_t now = io_time_get(IO_TIME_MONOTONIC_MSEC);
+
+  if (now - session->start_ms >= SASL_SLOW_MS)
+  {
+    if (sasl_slow_count == SASL_SLOW_RING)
+      ++sasl_slow_dropped;
+    else
+    {
+      struct sasl_slow *slow = &sasl_slow_ring[(sasl_slow_head + sasl_slow_count++) % SASL_SLOW_RING];
+
+      slow->when = io_time_get(IO_TIME_REALTIME_SEC);
+      strlcpy(slow->uid, session->client->id, sizeof(slow->uid));
+      strlcpy(slow->ip, session->client->sockhost, sizeof(slow->ip));
+      strlcpy(slow->authcid, session->authcid[0] ? session->authcid : "*", sizeof(slow->authcid));
+      slow->result = result;
+      slow->phases = session->phases;
+      memcpy(slow->trace, session->trace, sizeof(slow->trace));
+    }
+  }
+
+  session->start_ms = now;
+  session->phases = 0;
+}
+
+/*
+ * Event: write queued entries.  Time before a client C is spent on the
+ * client side, time before a services C or D on the services side (link
+ * plus Anope), which is what the two totals split.
+ */
+static void
+sasl_slow_flush(void *unused)
+{
+  if (sasl_slow_count == 0 && sasl_slow_dropped == 0)
+    return;
+
+  FILE *file = fopen(SASL_SLOW_LOG, "a");
+  if (file == NULL)
+  {
+    sasl_slow_head = sasl_slow_count = 0;
+    return;
+  }
+
+  for (unsigned int n = 0; n < SASL_SLOW_PER_TICK && sasl_slow_count; ++n)
+  {
+    const struct sasl_slow *slow = &sasl_slow_ring[sasl_slow_head];
+    uint32_t client_ms = 0, services_ms = 0, last = 0;
+    char when[32], phases[SASL_TRACE_LEN * 16] = "";
+
+    for (unsigned int i = 0; i < slow->phases; ++i)
+    {
+      char buf[16];
 
-/*
- * SASL session state — tracks each in-progress SASL negotiation.
- * Sessions are keyed by client pointer and cleaned up on client exit.
- */
-struct sasl_session
+      if (slow->trace[i].what == 'C')
+        client_ms += slow->trace[i].ms - last;
+      else
+        services_ms += slow->trace[i].ms - last;
+      last = slow->trace[i].ms;
+
+      snprintf(buf, sizeof(buf), " %c=%u", slow->trace[i].what, slow->trace[i].ms);
+      strlcat(phases, buf, sizeof(phases));
+    }
+
+    const time_t t = slow->when;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+
+    fprintf(file, "%s uid=%s ip=%s authcid=%s result=%c total=%u services=%u client=%u%s\n",
+            when, slow->uid, slow->ip, slow->authcid, slow->result,
+            last, services_ms, client_ms, phases);
+
+    sasl_slow_head = (sasl_slow_head + 1) % SASL_SLOW_RING;
+    --sasl_slow_count;
+  }
+
+  if (sasl_slow_dropped)
+  {
+    fprintf(file, "%u slow logins not logged (queue full)\n", sasl_slow_dropped);
+    sasl_slow_dropped = 0;
+  }
+
+  fclose(file);
+}
+
+static struct event sasl_slow_event =
 {
-  struct Client *client;         /* The local client performing SASL */
-  char agent[IDLEN + 1];        /* UID of the services agent handling this session */
-  unsigned int messages;         /* Number of AUTHENTICATE messages received */
-  unsigned int failures;         /* Number of failed authentication attempts */
-  uintmax_t start_time;         /* Monotonic time when session started */
-  bool complete;                 /* True once D (done) received from services */
+  .name = "sasl_slow_flush",
+  .handler = sasl_slow_flush,
+  .when = 1
 };
 
-static struct sasl_session sessions[SASL_MAX_SESSIONS];
+
+/* ----------------------------------------------------------------
+ * Mechanism list: services' mechanisms plus the ones handled locally
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_register_cap(void)
+{
+  char mechs[sizeof(sasl_mechs) + sizeof(SASL_RESUME_MECH) + 1];
+
+  strlcpy(mechs, sasl_mechs, sizeof(mechs));
+
+  if (resume_keylen)
+  {
+    if (mechs[0])
+      strlcat(mechs, ",", sizeof(mechs));
+    strlcat(mechs, SASL_RESUME_MECH, sizeof(mechs));
+  }
+
+  cap_unregister("sasl");
+  cap_register(CAP_SASL, "sasl", mechs[0] ? mechs : NULL);
+}
+
+static void
+sasl_set_mechs(const char *mechs)
+{
+  strlcpy(sasl_mechs, mechs ? mechs : "", sizeof(sasl_mechs));
+  sasl_register_cap();
+}
 
 
 /* ----------------------------------------------------------------
- * Session management helpers
+ * Resumption tokens
  * ---------------------------------------------------------------- */
 
-static struct sasl_session *
-sasl_find_session(const struct Client *client)
+#ifdef HAVE_LIBCRYPTO
+/* Hex HMAC-SHA256 of "account:generation:expiry" into mac (65 bytes) */
+static void
+sasl_resume_mac(const char *account, uintmax_t generation, uintmax_t expiry, char mac[65])
 {
-  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
-    if (sessions[i].client == client)
-      return &sessions[i];
-  return NULL;
+  char data[ACCOUNTLEN + 1 + 21 + 21];
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digestlen = 0;
+
+  int len = snprintf(data, sizeof(data), "%s:%ju:%ju", account, generation, expiry);
+  HMAC(EVP_sha256(), resume_key, resume_keylen, (const unsigned char *)data, len, digest, &digestlen);
+
+  for (unsigned int i = 0; i < digestlen && i < 32; ++i)
+    snprintf(mac + i * 2, 3, "%02x", digest[i]);
 }
+#endif
 
-static struct sasl_session *
-sasl_new_session(struct Client *client)
+/* Give a freshly logged-in client a token for its next connection */
+static void
+sasl_resume_issue(struct Client *client)
 {
-  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+#ifdef HAVE_LIBCRYPTO
+  if (resume_keylen == 0 || !HasCap(client, CAP_STANDARD_REPLIES))
+    return;
+
+  if (client->account[0] == '\0' || strcmp(client->account, "*") == 0)
+    return;
+
+  const struct sasl_gen *gen = sasl_gen_find(client->account);
+  if (gen == NULL)
+    return;
+
+  char mac[65];
+  uintmax_t expiry = io_time_get(IO_TIME_REALTIME_SEC) + SASL_RESUME_TTL;
+
+  sasl_resume_mac(client->account, gen->generation, expiry, mac);
+  sendto_one(client, ":%s NOTE AUTHENTICATE RESUME_TOKEN %s:%ju:%ju:%s :Resume with SASL " SASL_RESUME_MECH,
+             me.name, client->account, gen->generation, expiry, mac);
+#endif
+}
+
+/* Finish a session that was decided locally */
+static void
+sasl_local_result(struct Client *client, const char *account)
+{
+  if (account)
   {
-    if (sessions[i].client == NULL)
-    {
-      memset(&sessions[i], 0, sizeof(sessions[i]));
-      sessions[i].client = client;
-      sessions[i].start_time = io_time_get(IO_TIME_MONOTONIC_SEC);
-      return &sessions[i];
-    }
+    strlcpy(client->account, account, sizeof(client->account));
+    sendto_one_numeric(client, &me, 900 | SND_EXPLICIT,
+                       "%s %s!%s@%s %s :You are now logged in as %s",
+                       client->name,
+                       client->name, client->username, client->host,
+                       client->account, client->account);
+    sendto_one_numeric(client, &me, 903 | SND_EXPLICIT,
+                       "%s :SASL authentication successful", client->name);
+    sasl_resume_issue(client);
+    ++sasl_stats.succeeded;
   }
-  return NULL;
+  else
+  {
+    sendto_one_numeric(client, &me, 904 | SND_EXPLICIT,
+                       "%s :SASL authentication failed", client->name);
+    sasl_throttle_failure(client);
+    sasl_stats_failure(client);
+  }
+}
+
+/* Check a decoded token; on success copy its account into account */
+static bool
+sasl_resume_verify(char *token, char *account, size_t size)
+{
+#ifdef HAVE_LIBCRYPTO
+  if (resume_keylen == 0)
+    return false;
+
+  char *mac = strrchr(token, ':');
+  if (mac == NULL)
+    return false;
+  *mac++ = '\0';
+
+  char *expiry = strrchr(token, ':');
+  if (expiry == NULL || expiry == token)
+    return false;
+  *expiry++ = '\0';
+
+  char *generation = strrchr(token, ':');
+  if (generation == NULL || generation == token)
+    return false;
+  *generation++ = '\0';
+
+  char *end;
+  errno = 0;
+  uintmax_t when = strtoull(expiry, &end, 10);
+  if (errno || *end || end == expiry || when < io_time_get(IO_TIME_REALTIME_SEC))
+    return false;
+
+  uintmax_t gen = strtoull(generation, &end, 10);
+  if (errno || *end || end == generation)
+    return false;
+
+  if (strlen(token) > ACCOUNTLEN || strlen(mac) != 64)
+    return false;
+
+  char expect[65];
+  sasl_resume_mac(token, gen, when, expect);
+  if (CRYPTO_memcmp(expect, mac, 64) != 0)
+    return false;
+
+  /* Revoked: password changed, suspended or dropped since it was issued */
+  const struct sasl_gen *current = sasl_gen_find(token);
+  if (current == NULL || current->generation != gen)
+    return false;
+
+  strlcpy(account, token, size);
+  return true;
+#else
+  return false;
+#endif
 }
 
+
+/* ----------------------------------------------------------------
+ * Routing towards services
+ *
+ * ENCAP * queues every SASL line on every server link.  Once the
+ * agent, or at least the services server, is known, the line is
+ * addressed to that server and queued on the one link leading to it,
+ * ahead of whatever is already in that link's sendq (a netjoin burst,
+ * say), through the core's priority lane (ircd-patch/send_priority.c).
+ * ---------------------------------------------------------------- */
+
 static void
-sasl_clear_session(struct sasl_session *session)
+sasl_encap(const char *agent, const char *fmt, ...)
 {
-  memset(session, 0, sizeof(*session));
+  char buf[IRCD_BUFSIZE];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  struct Client *target = NULL;
+
+  if (!string_is_empty(agent) && strcmp(agent, "*") != 0)
+    target = hash_find_id(agent);
+  if (target == NULL && sasl_services_sid[0])
+    target = hash_find_id(sasl_services_sid);
+
+  if (target && target->from && IsServer(target->from))
+  {
+    const struct Client *server = IsServer(target) ? target : target->servptr;
+    sendto_one_priority(target->from, ":%s ENCAP %s SASL %s", me.id, server->name, buf);
+  }
+  else
+  {
+    /* ENCAP * by hand, so each copy gets the priority lane too */
+    dlink_node *node;
+    DLINK_FOREACH(node, local_server_list.head)
+      sendto_one_priority(node->data, ":%s ENCAP * SASL %s", me.id, buf);
+  }
 }
 
 
@@ -98,21 +1414,77 @@ sasl_client_exit_hook(void *data)
   const ircd_hook_client_exit_ctx *ctx = data;
   struct sasl_session *session = sasl_find_session(ctx->client);
 
+  sasl_flood_forget(ctx->client);
+
   if (session)
   {
     /* Notify services of the abort if we know the agent */
     if (session->agent[0] && ctx->client->id[0])
-      sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s %s D A",
-                     me.id, ctx->client->id, session->agent);
+      sasl_encap(session->agent, "%s %s D A",
+                 ctx->client->id, session->agent);
+    sasl_clear_session(session);
+  }
+
+  return HOOK_FLOW_CONTINUE;
+}
+
+
+/* ----------------------------------------------------------------
+ * Hook: a remote client or server exits.  If it is a session's agent,
+ * or the server agents live on (services restarting or split), nobody
+ * will answer those sessions any more; fail them all in one pass rather
+ * than leaving them to the hold timeout or the client.  Losing the
+ * services server also fails the sessions no agent has picked up yet.
+ * ---------------------------------------------------------------- */
+
+static hook_flow_t
+sasl_remote_exit_hook(void *data)
+{
+  const ircd_hook_client_exit_ctx *ctx = data;
+  const struct Client *client = ctx->client;
+
+  if (client->id[0] == '\0')
+    return HOOK_FLOW_CONTINUE;
+
+  /* A SID matches every agent on that server, a UID just the one */
+  const size_t len = strlen(client->id);
+  const bool services = IsServer(client) && strcmp(client->id, sasl_services_sid) == 0;
+
+  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+  {
+    struct sasl_session *session = &sessions[i];
+    struct Client *target = session->client;
+
+    if (target == NULL || session->resume || session->external[0])
+      continue;
+
+    if (session->agent[0] ? strncmp(session->agent, client->id, len) != 0 : !services)
+      continue;
+
+    sendto_one_numeric(target, &me, 904 | SND_EXPLICIT,
+                       "%s :SASL authentication failed, services unavailable", target->name);
+    ++sasl_stats.timedout;
+
+    /* We are inside exit_client(): no registration from here */
     sasl_clear_session(session);
+    sasl_release_later(target);
   }
 
+  /* Route by broadcast until services answer again */
+  if (services)
+    sasl_services_sid[0] = '\0';
+
   return HOOK_FLOW_CONTINUE;
 }
 
 
 /* ----------------------------------------------------------------
- * AUTHENTICATE command handler (unregistered clients only)
+ * AUTHENTICATE command handler
+ *
+ * Registered clients may authenticate again (IRCv3 sasl-3.2) to switch
+ * accounts in place.  Their sessions always go through services, which
+ * log the user in network-wide; X-RESUME and the EXTERNAL cache only
+ * set the account locally and so are kept to registration time.
  *
  * Flow:
  *   1. Client sends  AUTHENTICATE PLAIN         (mechanism selection)
@@ -120,6 +1492,8 @@ sasl_client_exit_hook(void *data)
  *   3. Module sends   ENCAP * SASL uid * S PLAIN    (start auth)
  *   4. Services sends ENCAP sid SASL agent uid C +   (request credentials)
  *   5. Module relays  AUTHENTICATE +                 (to client)
+ *      For PLAIN/EXTERNAL the module sends AUTHENTICATE + right after
+ *      step 3 and swallows the C + of step 4 (see sasl_empty_challenge)
  *   6. Client sends  AUTHENTICATE base64data        (credentials)
  *   7. Module sends   ENCAP * SASL uid agent C b64   (relay to services)
  *   8. Services sends ENCAP sid SVSLOGIN uid ...      (set account)
@@ -128,7 +1502,7 @@ sasl_client_exit_hook(void *data)
  * ---------------------------------------------------------------- */
 
 static void
-mr_authenticate(struct Client *source, int parc, char *parv[])
+m_authenticate(struct Client *source, int parc, char *parv[])
 {
   /* Client must have requested sasl capability */
   if (!HasCap(source, CAP_SASL))
@@ -142,33 +1516,54 @@ mr_authenticate(struct Client *source, int parc, char *parv[])
     if (session)
     {
       if (session->agent[0] && source->id[0])
-        sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s %s D A",
-                       me.id, source->id, session->agent);
-      sasl_clear_session(session);
+        sasl_encap(session->agent, "%s %s D A",
+                   source->id, session->agent);
     }
 
-    sendto_one_numeric(source, &me, 906 | SND_EXPLICIT,
-                       "%s :SASL authentication aborted", source->name);
+    /* Still aborted, but start/abort cycles drain the budget too */
+    if (!sasl_flood_charge(source, strlen(parv[1])))
+      sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
+                         "%s :SASL message limit exceeded", source->name);
+    else
+      sendto_one_numeric(source, &me, 906 | SND_EXPLICIT,
+                         "%s :SASL authentication aborted", source->name);
+
+    if (session)
+      sasl_end_session(session);
     return;
   }
 
   /* Assign a UID early so services can reference this client.
    * The user.c patch prevents user_register_local() from overwriting this. */
-  if (source->id[0] == '\0')
-  {
-    const char *id;
-    while (hash_find_id((id = uid_get())))
-      ;
-    strlcpy(source->id, id, sizeof(source->id));
-    hash_add_id(source);
-  }
+  sasl_assign_uid(source);
 
   struct sasl_session *session = sasl_find_session(source);
 
   if (session == NULL)
   {
+    /* Too many recent failures from this network: don't bother services */
+    const uintmax_t blocked = sasl_throttle_blocked(source);
+    if (blocked)
+    {
+      sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
+                         "%s :SASL authentication failed, too many failures (retry in %ju seconds)",
+                         source->name, blocked);
+      ++sasl_stats.refused;
+      return;
+    }
+
+    /* Charged like any other line: no session, no ENCAP when dry */
+    if (!sasl_flood_charge(source, strlen(parv[1])))
+    {
+      sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
+                         "%s :SASL message limit exceeded", source->name);
+      ++sasl_stats.refused;
+      return;
+    }
+
     /* New SASL session — mechanism selection */
     session = sasl_new_session(source);
+    ++sasl_stats.started;
     if (session == NULL)
     {
       sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
@@ -176,36 +1571,283 @@ mr_authenticate(struct Client *source, int parc, char *parv[])
       return;
     }
 
+    /* CAP END from here on waits for the outcome */
+    if (!IsClient(source))
+      source->connection->registration |= REG_NEED_SASL;
+
+    /* Resumption token: checked locally, services never see it */
+    if (!IsClient(source) && resume_keylen && strcasecmp(parv[1], SASL_RESUME_MECH) == 0)
+    {
+      session->resume = true;
+      sendto_one(source, "AUTHENTICATE +");
+      return;
+    }
+
+    /* EXTERNAL with a certificate services told us about */
+    if (!IsClient(source) && strcasecmp(parv[1], "EXTERNAL") == 0 && !string_is_empty(source->certfp))
+    {
+      const struct sasl_cert *cert = sasl_cert_find(source->certfp);
+      if (cert)
+      {
+        strlcpy(session->external, cert->account, sizeof(session->external));
+        sendto_one(source, "AUTHENTICATE +");
+        return;
+      }
+    }
+
     /* Send client host/IP info to services (H command) */
-    sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s * H %s %s",
-                   me.id, source->id, source->host, source->sockhost);
+    sasl_encap(NULL, "%s * H %s %s",
+               source->id, source->host, source->sockhost);
 
     /* Send mechanism start (S command) */
-    sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s * S %s",
-                   me.id, source->id, parv[1]);
+    sasl_encap(NULL, "%s * S %s",
+               source->id, parv[1]);
+
+    session->plain = strcasecmp(parv[1], "PLAIN") == 0;
+
+    /* Empty first challenge: don't make the client wait for services */
+    if (sasl_starts_empty(parv[1]))
+    {
+      session->speculative = true;
+      sendto_one(source, "AUTHENTICATE +");
+    }
   }
   else
   {
+    /* Our own PASS login is running; the client has nothing to add */
+    if (session->pass)
+    {
+      sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
+                         "%s :SASL authentication failed", source->name);
+      return;
+    }
+
     /* Continuation — relay client data to services (C command) */
-    if (++session->messages > SASL_MAX_MESSAGES)
+    if (++session->messages > SASL_MAX_MESSAGES || !sasl_flood_charge(source, strlen(parv[1])))
     {
       sendto_one_numeric(source, &me, 904 | SND_EXPLICIT,
                          "%s :SASL message limit exceeded", source->name);
 
       if (session->agent[0])
-        sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s %s D A",
-                       me.id, source->id, session->agent);
-      sasl_clear_session(session);
+        sasl_encap(session->agent, "%s %s D A",
+                   source->id, session->agent);
+      sasl_end_session(session);
+      return;
+    }
+
+    if (session->resume)
+    {
+      char token[SASL_TOKENLEN + 1], account[ACCOUNTLEN + 1];
+
+      if (sasl_base64_decode(parv[1], token, sizeof(token)) > 0 &&
+          sasl_resume_verify(token, account, sizeof(account)))
+        sasl_local_result(source, account);
+      else
+        sasl_local_result(source, NULL);
+
+      sasl_end_session(session);
+      return;
+    }
+
+    if (session->external[0])
+    {
+      /* Empty authzid, or one naming the certificate's own account */
+      char authzid[ACCOUNTLEN + 1];
+
+      if (strcmp(parv[1], "+") == 0 ||
+          (sasl_base64_decode(parv[1], authzid, sizeof(authzid)) > 0 &&
+           irccmp(authzid, session->external) == 0))
+        sasl_local_result(source, session->external);
+      else
+        sasl_local_result(source, NULL);
+
+      sasl_end_session(session);
       return;
     }
 
-    sendto_servers(NULL, 0, 0, ":%s ENCAP * SASL %s %s C %s",
-                   me.id, source->id,
-                   session->agent[0] ? session->agent : "*",
-                   parv[1]);
-  }
+    sasl_phase(session, 'C');
+
+    /* Credentials for an account under attack: answer for services */
+    if (session->plain)
+    {
+      session->plain = false;
+
+      if (sasl_plain_authcid(parv[1], session->authcid) && !sasl_exempt(source) &&
+          sasl_authcid_blocked(session->authcid))
+      {
+        sasl_encap(session->agent, "%s %s D A",
+                   source->id, session->agent[0] ? session->agent : "*");
+        sasl_local_result(source, NULL);
+        ++sasl_stats.refused;
+        sasl_end_session(session);
+        return;
+      }
+    }
+
+    sasl_encap(session->agent, "%s %s C %s",
+               source->id, session->agent[0] ? session->agent : "*", parv[1]);
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * PASS wrapper: PASS account:password becomes a PLAIN session
+ *
+ * The core handler runs first and keeps the password for auth {}
+ * blocks as before.  The session is sent to services in one go
+ * (H, S PLAIN, C response); services' C + is swallowed as for a
+ * speculative PLAIN, and the client only sees the numerics.  Anything
+ * that rules the login out leaves the client to register as usual.
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_pass_login(struct Client *source, const char *pass)
+{
+  const char *colon = strchr(pass, ':');
+
+  if (colon == NULL || colon == pass || colon[1] == '\0' || colon - pass > ACCOUNTLEN)
+    return;
+
+  if (source->account[0] || sasl_find_session(source) || sasl_throttle_blocked(source))
+    return;
+
+  /* authzid (empty) NUL authcid NUL passwd */
+  unsigned char plain[IRCD_BUFSIZE];
+  char response[IRCD_BUFSIZE * 2];
+  const size_t account_len = colon - pass, password_len = strlen(colon + 1);
+
+  if (2 + account_len + password_len > sizeof(plain))
+    return;
+
+  plain[0] = '\0';
+  memcpy(plain + 1, pass, account_len);
+  plain[1 + account_len] = '\0';
+  memcpy(plain + 2 + account_len, colon + 1, password_len);
+
+  const int response_len = sasl_base64_encode(plain, 2 + account_len + password_len, response, sizeof(response));
+  memset(plain, 0, sizeof(plain));
+
+  if (response_len < 0)
+    return;
+
+  struct sasl_session *session = sasl_new_session(source);
+  if (session == NULL)
+    return;
+
+  for (size_t i = 0; i < account_len; ++i)
+    session->authcid[i] = ToLower(pass[i]);
+  session->authcid[account_len] = '\0';
+
+  if (!sasl_exempt(source) && sasl_authcid_blocked(session->authcid))
+  {
+    ++sasl_stats.refused;
+    sasl_clear_session(session);
+    return;
+  }
+
+  ++sasl_stats.started;
+  session->pass = true;
+  session->speculative = true;
+  source->connection->registration |= REG_NEED_SASL;
+
+  sasl_assign_uid(source);
+  sasl_encap(NULL, "%s * H %s %s",
+             source->id, source->host, source->sockhost);
+  sasl_encap(NULL, "%s * S PLAIN",
+             source->id);
+
+  sasl_phase(session, 'C');
+
+  /* 400-byte chunks; a response that fills the last one ends with + */
+  for (int offset = 0; ; offset += 400)
+  {
+    const int chunk = response_len - offset < 400 ? response_len - offset : 400;
+
+    sasl_encap(NULL, "%s * C %.*s",
+               source->id, chunk ? chunk : 1, chunk ? response + offset : "+");
+    if (chunk < 400)
+      break;
+  }
+
+  memset(response, 0, sizeof(response));
+}
+
+/* PASS is the password of the auth {} block the client will match */
+static bool
+sasl_pass_is_auth(struct Client *client, const char *pass)
+{
+  char username[USERLEN + 1] = "~";
+
+  if (HasFlag(client, FLAGS_GOTID))
+    strlcpy(username, client->username, sizeof(username));
+  else
+    strlcpy(username + 1, client->username, sizeof(username) - 1);
+
+  const struct MaskItem *conf = find_address_conf(client->host, username, &client->ip, pass);
+  return conf && IsConfClient(conf) && !string_is_empty(conf->passwd) && match_conf_password(pass, conf);
+}
+
+/* After NICK, USER or CAP: start the PASS login once nothing else holds registration */
+static void
+sasl_pass_check(struct Client *source)
+{
+  if (HasFlag(source, FLAGS_CLOSING) || source->connection->registration != REG_NEED_SASL)
+    return;
+
+  /* A SASL session of the client's own is running */
+  if (sasl_find_session(source))
+    return;
+
+  const char *pass = source->connection->password;
+  if (sasl_pass_enabled && !HasCap(source, CAP_SASL) && !string_is_empty(pass) && !sasl_pass_is_auth(source, pass))
+    sasl_pass_login(source, pass);
+
+  if (sasl_find_session(source) == NULL)
+    sasl_release(source);
+}
+
+static void
+mr_pass_sasl(struct Client *source, int parc, char *parv[])
+{
+  sasl_wraps[SASL_WRAP_PASS].handler(source, parc, parv);
+
+  /* Servers send PASS password TS 6 :SID */
+  if (parc > 2 && !string_is_empty(parv[2]))
+    return;
+
+  if (sasl_pass_enabled && parc > 1 && strchr(parv[1], ':'))
+    source->connection->registration |= REG_NEED_SASL;
+}
+
+static void
+mr_nick_sasl(struct Client *source, int parc, char *parv[])
+{
+  sasl_wraps[SASL_WRAP_NICK].handler(source, parc, parv);
+  sasl_pass_check(source);
+}
+
+static void
+mr_user_sasl(struct Client *source, int parc, char *parv[])
+{
+  sasl_wraps[SASL_WRAP_USER].handler(source, parc, parv);
+  sasl_pass_check(source);
+}
+
+static void
+mr_cap_sasl(struct Client *source, int parc, char *parv[])
+{
+  sasl_wraps[SASL_WRAP_CAP].handler(source, parc, parv);
+  sasl_pass_check(source);
 }
 
+static void (*const sasl_wrappers[SASL_WRAP_COUNT])(struct Client *, int, char *[]) =
+{
+  [SASL_WRAP_PASS] = mr_pass_sasl,
+  [SASL_WRAP_NICK] = mr_nick_sasl,
+  [SASL_WRAP_USER] = mr_user_sasl,
+  [SASL_WRAP_CAP] = mr_cap_sasl,
+};
+
 
 /* ----------------------------------------------------------------
  * SASL ENCAP handler — responses from services
@@ -233,14 +1875,35 @@ me_sasl(struct Client *source, int parc, char *parv[])
       if (parc < 5)
         break;
 
-      sendto_one(target, "AUTHENTICATE %s", parv[4]);
-
       /* Remember the agent UID for future relay messages */
       if (session && session->agent[0] == '\0')
         strlcpy(session->agent, parv[1], sizeof(session->agent));
+
+      /* ...and its server, for sessions that have no agent yet */
+      strlcpy(sasl_services_sid, parv[1], sizeof(sasl_services_sid));
+
+      if (session)
+        sasl_phase(session, 'c');
+
+      /* The empty challenge we already answered locally */
+      if (session && session->speculative)
+      {
+        session->speculative = false;
+        if (strcmp(parv[4], "+") == 0)
+          break;
+      }
+
+      /* PASS logins have no client side to relay to */
+      if (session && session->pass)
+        break;
+
+      sendto_one(target, "AUTHENTICATE %s", parv[4]);
       break;
 
     case 'D':  /* Done — authentication result */
+      if (session)
+        sasl_phase_done(session, parc >= 5 ? parv[4][0] : '?');
+
       if (parc >= 5 && parv[4][0] == 'S')
       {
         /* Success */
@@ -252,11 +1915,13 @@ me_sasl(struct Client *source, int parc, char *parv[])
         sendto_one_numeric(target, &me, 903 | SND_EXPLICIT,
                            "%s :SASL authentication successful",
                            target->name);
+        sasl_resume_issue(target);
+        ++sasl_stats.succeeded;
 
         if (session)
         {
           session->complete = true;
-          sasl_clear_session(session);
+          sasl_end_session(session);
         }
       }
       else
@@ -264,16 +1929,28 @@ me_sasl(struct Client *source, int parc, char *parv[])
         /* Failure */
         unsigned int failures = 0;
 
+        sasl_throttle_failure(target);
+        sasl_stats_failure(target);
+
+        if (session && session->authcid[0])
+        {
+          if (!sasl_exempt(target))
+            sasl_authcid_failure(session->authcid);
+          session->authcid[0] = '\0';
+        }
+
         if (session)
         {
           failures = ++session->failures;
 
-          if (failures >= SASL_MAX_FAILURES)
+          /* A PASS login cannot be retried, and a registered client
+           * starts over with a new AUTHENTICATE rather than keep a slot */
+          if (failures >= SASL_MAX_FAILURES || session->pass || IsClient(target))
           {
             sendto_one_numeric(target, &me, 904 | SND_EXPLICIT,
                                "%s :SASL authentication failed",
                                target->name);
-            sasl_clear_session(session);
+            sasl_end_session(session);
             break;
           }
         }
@@ -281,6 +1958,9 @@ me_sasl(struct Client *source, int parc, char *parv[])
         sendto_one_numeric(target, &me, 904 | SND_EXPLICIT,
                            "%s :SASL authentication failed",
                            target->name);
+
+        /* The session stays for the failure count; the hold does not */
+        sasl_release(target);
       }
       break;
 
@@ -290,12 +1970,8 @@ me_sasl(struct Client *source, int parc, char *parv[])
       break;
 
     case 'M':  /* Mechanism list update */
-    {
-      const char *mechs = (parc >= 5 && !string_is_empty(parv[4])) ? parv[4] : NULL;
-      cap_unregister("sasl");
-      cap_register(CAP_SASL, "sasl", mechs);
+      sasl_set_mechs(parc >= 5 ? parv[4] : NULL);
       break;
-    }
   }
 }
 
@@ -312,6 +1988,48 @@ me_sasl(struct Client *source, int parc, char *parv[])
  *   parv[5] = account
  * ---------------------------------------------------------------- */
 
+/* Account change for a registered client through the core's SVSACCOUNT
+ * handler, which sends account-notify and passes it on to servers */
+static void
+sasl_svsaccount(struct Client *source, struct Client *target, char *account)
+{
+  const struct Command *cmd = command_find("SVSACCOUNT");
+  char ts[24];
+
+  if (cmd == NULL || cmd->handlers[SERVER_HANDLER].handler == NULL)
+  {
+    strlcpy(target->account, account, sizeof(target->account));
+    return;
+  }
+
+  snprintf(ts, sizeof(ts), "%ju", target->tsinfo);
+
+  char *parv[] = { "SVSACCOUNT", target->id, ts, account, NULL };
+  cmd->handlers[SERVER_HANDLER].handler(source, 4, parv);
+}
+
+/* Host change for a registered client through the core's SVSHOST
+ * handler, which sends chghost and passes it on to servers */
+static void
+sasl_svshost(struct Client *source, struct Client *target, char *host)
+{
+  const struct Command *cmd = command_find("SVSHOST");
+  char ts[24];
+
+  if (cmd == NULL || cmd->handlers[SERVER_HANDLER].handler == NULL)
+  {
+    user_set_hostmask(target, host);
+    sendto_servers(source, 0, 0, ":%s SVSHOST %s %ju %s",
+                   source->id, target->id, target->tsinfo, host);
+    return;
+  }
+
+  snprintf(ts, sizeof(ts), "%ju", target->tsinfo);
+
+  char *parv[] = { "SVSHOST", target->id, ts, host, NULL };
+  cmd->handlers[SERVER_HANDLER].handler(source, 4, parv);
+}
+
 static void
 me_svslogin(struct Client *source, int parc, char *parv[])
 {
@@ -322,17 +2040,31 @@ me_svslogin(struct Client *source, int parc, char *parv[])
   if (target == NULL)
     return;
 
-  /* Set account name */
-  if (parc >= 6 && strcmp(parv[5], "*") != 0)
-    strlcpy(target->account, parv[5], sizeof(target->account));
+  const bool set_account = parc >= 6 && strcmp(parv[5], "*") != 0 && strcmp(parv[5], target->account) != 0;
+  const bool set_host = parc >= 5 && strcmp(parv[4], "*") != 0 && strcmp(parv[4], target->host) != 0;
+  const bool set_username = parc >= 4 && strcmp(parv[3], "*") != 0;
 
-  /* Set vhost if provided */
-  if (parc >= 5 && strcmp(parv[4], "*") != 0)
-    strlcpy(target->host, parv[4], sizeof(target->host));
+  /* Nobody has seen an unregistered client yet */
+  if (!IsClient(target))
+  {
+    if (set_account)
+      strlcpy(target->account, parv[5], sizeof(target->account));
+    if (set_host)
+      strlcpy(target->host, parv[4], sizeof(target->host));
+    if (set_username)
+      strlcpy(target->username, parv[3], sizeof(target->username));
+    return;
+  }
 
-  /* Set ident if provided */
-  if (parc >= 4 && strcmp(parv[3], "*") != 0)
-    strlcpy(target->username, parv[3], sizeof(target->username));
+  /*
+   * A registered client goes through the same core paths as SVSACCOUNT
+   * and SVSHOST, so local users get ACCOUNT and CHGHOST from them.  The
+   * ident is left alone: there is no way to tell other servers.
+   */
+  if (set_account)
+    sasl_svsaccount(source, target, parv[5]);
+  if (set_host)
+    sasl_svshost(source, target, parv[4]);
 }
 
 
@@ -347,11 +2079,180 @@ me_svslogin(struct Client *source, int parc, char *parv[])
 static void
 me_mechlist(struct Client *source, int parc, char *parv[])
 {
-  const char *mechs = (parc >= 2 && !string_is_empty(parv[1])) ? parv[1] : NULL;
-  cap_unregister("sasl");
-  cap_register(CAP_SASL, "sasl", mechs);
+  sasl_set_mechs(parc >= 2 ? parv[1] : NULL);
+}
+
+
+/* ----------------------------------------------------------------
+ * SASLKEY ENCAP handler — resumption token key from services
+ *
+ * After ENCAP dispatch:
+ *   parv[0] = "SASLKEY"
+ *   parv[1] = key as hex, or "*" to disable X-RESUME
+ * ---------------------------------------------------------------- */
+
+static void
+me_saslkey(struct Client *source, int parc, char *parv[])
+{
+  if (!HasFlag(source, FLAGS_SERVICE) && !IsServer(source))
+    return;
+
+  resume_keylen = 0;
+
+#ifdef HAVE_LIBCRYPTO
+  const size_t len = strlen(parv[1]);
+
+  if (strcmp(parv[1], "*") != 0 && len % 2 == 0 && len / 2 <= sizeof(resume_key))
+  {
+    for (size_t i = 0; i < len; i += 2)
+    {
+      unsigned int byte;
+      if (sscanf(parv[1] + i, "%2x", &byte) != 1)
+      {
+        resume_keylen = 0;
+        break;
+      }
+      resume_key[resume_keylen++] = byte;
+    }
+  }
+
+  /* Services send the SHA-256 of their secret; anything else is a config
+   * or version mismatch that would otherwise turn X-RESUME off silently */
+  if (strcmp(parv[1], "*") != 0 && resume_keylen == 0)
+    sendto_clients(UMODE_SERVNOTICE, SEND_RECIPIENT_OPER_ALL, SEND_TYPE_NOTICE,
+                   "SASLKEY from %s rejected (%zu characters, want an even number of hex digits up to %zu); X-RESUME is off",
+                   source->name, len, sizeof(resume_key) * 2);
+#endif
+
+  sasl_register_cap();
+}
+
+
+/* ----------------------------------------------------------------
+ * SASLPASS ENCAP handler — PASS login switch from services
+ *
+ * After ENCAP dispatch:
+ *   parv[1] = ON or OFF
+ * ---------------------------------------------------------------- */
+
+static void
+me_saslpass(struct Client *source, int parc, char *parv[])
+{
+  if (!HasFlag(source, FLAGS_SERVICE) && !IsServer(source))
+    return;
+
+  sasl_pass_enabled = irccmp(parv[1], "ON") == 0;
+}
+
+
+/* ----------------------------------------------------------------
+ * SASLGEN ENCAP handler — resumption token generations from services
+ *
+ * After ENCAP dispatch:
+ *   parv[1] = ADD | DEL | CLEAR
+ *   parv[2] = "account generation ..." for ADD, "account ..." for DEL
+ * ---------------------------------------------------------------- */
+
+static void
+me_saslgen(struct Client *source, int parc, char *parv[])
+{
+  if (!HasFlag(source, FLAGS_SERVICE) && !IsServer(source))
+    return;
+
+  if (strcmp(parv[1], "CLEAR") == 0)
+  {
+    sasl_gen_clear();
+    return;
+  }
+
+  if (parc < 3)
+    return;
+
+  const bool add = strcmp(parv[1], "ADD") == 0;
+  if (!add && strcmp(parv[1], "DEL") != 0)
+    return;
+
+  char *save = NULL;
+  for (char *account = strtok_r(parv[2], " ", &save); account; account = strtok_r(NULL, " ", &save))
+  {
+    if (!add)
+    {
+      sasl_gen_del(account);
+      continue;
+    }
+
+    const char *generation = strtok_r(NULL, " ", &save);
+    if (generation == NULL)
+      break;
+
+    sasl_gen_set(account, strtoull(generation, NULL, 10));
+  }
+}
+
+
+/* ----------------------------------------------------------------
+ * SASLCERT ENCAP handler — certificate fingerprint cache from services
+ *
+ * After ENCAP dispatch:
+ *   parv[1] = ADD certfp account | DEL certfp | DELACCOUNT account | CLEAR
+ * ---------------------------------------------------------------- */
+
+static void
+me_saslcert(struct Client *source, int parc, char *parv[])
+{
+  if (!HasFlag(source, FLAGS_SERVICE) && !IsServer(source))
+    return;
+
+  if (strcmp(parv[1], "ADD") == 0 && parc >= 4)
+    sasl_cert_add(parv[2], parv[3]);
+  else if (strcmp(parv[1], "DEL") == 0 && parc >= 3)
+    sasl_cert_del(parv[2], NULL);
+  else if (strcmp(parv[1], "DELACCOUNT") == 0 && parc >= 3)
+    sasl_cert_del(NULL, parv[2]);
+  else if (strcmp(parv[1], "CLEAR") == 0)
+    sasl_cert_clear();
+}
+
+
+/* ----------------------------------------------------------------
+ * Event: abort sessions that have run too long, whether or not they
+ * hold registration, and register clients whose hold was dropped
+ * during an exit
+ * ---------------------------------------------------------------- */
+
+static void
+sasl_hold_timeout(void *unused)
+{
+  const uintmax_t now = io_time_get(IO_TIME_MONOTONIC_SEC);
+
+  sasl_register_pending();
+
+  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+  {
+    struct sasl_session *session = &sessions[i];
+    struct Client *client = session->client;
+
+    if (client == NULL || now - session->start_time < SASL_HOLD_TIMEOUT)
+      continue;
+
+    if (session->agent[0])
+      sasl_encap(session->agent, "%s %s D A",
+                 client->id, session->agent);
+
+    sendto_one_numeric(client, &me, 904 | SND_EXPLICIT,
+                       "%s :SASL authentication timed out", client->name);
+    ++sasl_stats.timedout;
+    sasl_end_session(session);
+  }
 }
 
+static struct event sasl_hold_event =
+{
+  .name = "sasl_hold_timeout",
+  .handler = sasl_hold_timeout,
+  .when = 1
+};
+
 
 /* ----------------------------------------------------------------
  * Command tables
@@ -360,11 +2261,11 @@ me_mechlist(struct Client *source, int parc, char *parv[])
 static struct Command authenticate_cmd =
 {
   .name = "AUTHENTICATE",
-  .handlers[UNREGISTERED_HANDLER] = { .handler = mr_authenticate, .args_min = 2 },
-  .handlers[CLIENT_HANDLER] = { .handler = m_registered },
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_authenticate, .args_min = 2 },
+  .handlers[CLIENT_HANDLER] = { .handler = m_authenticate, .args_min = 2 },
   .handlers[SERVER_HANDLER] = { .handler = m_ignore },
   .handlers[ENCAP_HANDLER] = { .handler = m_ignore },
-  .handlers[OPER_HANDLER] = { .handler = m_registered },
+  .handlers[OPER_HANDLER] = { .handler = m_authenticate, .args_min = 2 },
 };
 
 static struct Command sasl_cmd =
@@ -387,6 +2288,46 @@ static struct Command svslogin_cmd =
   .handlers[OPER_HANDLER] = { .handler = m_ignore },
 };
 
+static struct Command saslkey_cmd =
+{
+  .name = "SASLKEY",
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_ignore },
+  .handlers[CLIENT_HANDLER] = { .handler = m_ignore },
+  .handlers[SERVER_HANDLER] = { .handler = m_ignore },
+  .handlers[ENCAP_HANDLER] = { .handler = me_saslkey, .args_min = 2 },
+  .handlers[OPER_HANDLER] = { .handler = m_ignore },
+};
+
+static struct Command saslpass_cmd =
+{
+  .name = "SASLPASS",
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_ignore },
+  .handlers[CLIENT_HANDLER] = { .handler = m_ignore },
+  .handlers[SERVER_HANDLER] = { .handler = m_ignore },
+  .handlers[ENCAP_HANDLER] = { .handler = me_saslpass, .args_min = 2 },
+  .handlers[OPER_HANDLER] = { .handler = m_ignore },
+};
+
+static struct Command saslgen_cmd =
+{
+  .name = "SASLGEN",
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_ignore },
+  .handlers[CLIENT_HANDLER] = { .handler = m_ignore },
+  .handlers[SERVER_HANDLER] = { .handler = m_ignore },
+  .handlers[ENCAP_HANDLER] = { .handler = me_saslgen, .args_min = 2 },
+  .handlers[OPER_HANDLER] = { .handler = m_ignore },
+};
+
+static struct Command saslcert_cmd =
+{
+  .name = "SASLCERT",
+  .handlers[UNREGISTERED_HANDLER] = { .handler = m_ignore },
+  .handlers[CLIENT_HANDLER] = { .handler = m_ignore },
+  .handlers[SERVER_HANDLER] = { .handler = m_ignore },
+  .handlers[ENCAP_HANDLER] = { .handler = me_saslcert, .args_min = 2 },
+  .handlers[OPER_HANDLER] = { .handler = m_ignore },
+};
+
 static struct Command mechlist_cmd =
 {
   .name = "MECHLIST",
@@ -398,6 +2339,250 @@ static struct Command mechlist_cmd =
 };
 
 
+/* ----------------------------------------------------------------
+ * Reload handoff
+ *
+ * MODRELOAD runs exit_handler and init_handler back to back in the same
+ * process.  exit_handler writes the caches and the sessions to an
+ * anonymous memory file (memfd, never on disk: it holds the resume key)
+ * and leaves its descriptor, device and inode in the environment;
+ * init_handler reads them back if all three and the layout match.
+ * Sessions are written by client UID and resolved again on load, so a
+ * client that left in between is dropped; registration holds stay on
+ * the clients themselves and are picked up with their sessions.
+ *
+ * A module cannot tell an unload from the first half of a reload, so a
+ * plain MODUNLOAD leaves the file open too.  There is never more than
+ * one: the next unload or load of m_sasl closes it.  The descriptor is
+ * close-on-exec, so after a RESTART the variable names nothing and is
+ * ignored.
+ * ---------------------------------------------------------------- */
+
+#define SASL_HANDOFF_ENV      "M_SASL_HANDOFF"
+#define SASL_HANDOFF_MAGIC    0x5341534Cu  /* "SASL" */
+#define SASL_HANDOFF_VERSION  8            /* Bump on any layout change */
+
+/* A session as handed over; client is resolved again from uid */
+struct sasl_handoff_session
+{
+  char uid[IDLEN + 1];
+  struct sasl_session session;
+};
+
+/* Followed by gens struct sasl_gen, certs struct sasl_cert and sessions
+ * struct sasl_handoff_session, next unused */
+struct sasl_handoff
+{
+  uint32_t magic;
+  uint32_t version;
+  size_t size;                   /* sizeof(struct sasl_handoff) of the writer */
+
+  unsigned char resume_key[SASL_RESUME_KEYLEN];
+  size_t resume_keylen;
+  bool pass_enabled;
+  char mechs[sizeof(sasl_mechs)];
+  struct sasl_throttle throttles[SASL_THROTTLE_SIZE];
+  unsigned char authcids[SASL_AUTHCID_COUNTERS];
+  size_t gens;
+  size_t certs;
+  size_t sessions;
+};
+
+static bool
+sasl_handoff_write(int fd, const void *buf, size_t len)
+{
+  for (const char *p = buf; len; )
+  {
+    const ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+static bool
+sasl_handoff_read(int fd, void *buf, size_t len)
+{
+  for (char *p = buf; len; )
+  {
+    const ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+/* The handoff file the environment names, or -1; the variable is cleared */
+static int
+sasl_handoff_take(void)
+{
+  const char *env = getenv(SASL_HANDOFF_ENV);
+  int fd;
+  uintmax_t dev, ino;
+
+  if (env == NULL)
+    return -1;
+
+  const int fields = sscanf(env, "%d %ju %ju", &fd, &dev, &ino);
+  unsetenv(SASL_HANDOFF_ENV);
+
+  /* Inherited across an exec, or a number since reused for something else */
+  struct stat st;
+  if (fields != 3 || fstat(fd, &st) != 0 || st.st_dev != dev || st.st_ino != ino)
+    return -1;
+
+  return fd;
+}
+
+/* True if everything, sessions included, was handed over */
+static bool
+sasl_handoff_save(void)
+{
+  /* One left by an unload that no load followed */
+  int fd = sasl_handoff_take();
+  if (fd >= 0)
+    close(fd);
+
+#if defined(MFD_CLOEXEC)
+  fd = memfd_create("m_sasl", MFD_CLOEXEC);
+#elif defined(SYS_memfd_create)
+  fd = syscall(SYS_memfd_create, "m_sasl", 1u /* MFD_CLOEXEC */);
+#else
+  fd = -1;  /* Nowhere to put the key that is never written out */
+#endif
+
+  if (fd < 0)
+    return false;
+
+  struct sasl_handoff *handoff = io_calloc(sizeof(*handoff));
+  handoff->magic = SASL_HANDOFF_MAGIC;
+  handoff->version = SASL_HANDOFF_VERSION;
+  handoff->size = sizeof(*handoff);
+
+  memcpy(handoff->resume_key, resume_key, sizeof(resume_key));
+  handoff->resume_keylen = resume_keylen;
+  handoff->pass_enabled = sasl_pass_enabled;
+  memcpy(handoff->mechs, sasl_mechs, sizeof(sasl_mechs));
+  memcpy(handoff->throttles, sasl_throttles, sizeof(sasl_throttles));
+  memcpy(handoff->authcids, sasl_authcids, sizeof(sasl_authcids));
+
+  for (unsigned int i = 0; i < SASL_GEN_BUCKETS; ++i)
+    for (const struct sasl_gen *gen = sasl_gens[i]; gen; gen = gen->next)
+      ++handoff->gens;
+  for (unsigned int i = 0; i < SASL_CERT_BUCKETS; ++i)
+    for (const struct sasl_cert *cert = sasl_certs[i]; cert; cert = cert->next)
+      ++handoff->certs;
+  for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+    if (sessions[i].client)
+      ++handoff->sessions;
+
+  bool ok = sasl_handoff_write(fd, handoff, sizeof(*handoff));
+
+  for (unsigned int i = 0; ok && i < SASL_GEN_BUCKETS; ++i)
+    for (const struct sasl_gen *gen = sasl_gens[i]; ok && gen; gen = gen->next)
+      ok = sasl_handoff_write(fd, gen, sizeof(*gen));
+  for (unsigned int i = 0; ok && i < SASL_CERT_BUCKETS; ++i)
+    for (const struct sasl_cert *cert = sasl_certs[i]; ok && cert; cert = cert->next)
+      ok = sasl_handoff_write(fd, cert, sizeof(*cert));
+  for (unsigned int i = 0; ok && i < SASL_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i].client == NULL)
+      continue;
+
+    struct sasl_handoff_session record = { .session = sessions[i] };
+    strlcpy(record.uid, sessions[i].client->id, sizeof(record.uid));
+    record.session.client = NULL;
+    ok = sasl_handoff_write(fd, &record, sizeof(record));
+  }
+
+  memset(handoff, 0, sizeof(*handoff));
+  io_free(handoff);
+
+  struct stat st;
+  if (!ok || fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  char env[64];
+  snprintf(env, sizeof(env), "%d %ju %ju", fd, (uintmax_t)st.st_dev, (uintmax_t)st.st_ino);
+  setenv(SASL_HANDOFF_ENV, env, 1);
+  return true;
+}
+
+/* A handed-over session whose client is still here, unchanged */
+static void
+sasl_handoff_session(const struct sasl_handoff_session *record)
+{
+  struct Client *client = record->uid[0] ? hash_find_id(record->uid) : NULL;
+
+  if (client == NULL || !MyConnect(client) || HasFlag(client, FLAGS_CLOSING) ||
+      sasl_find_session(client))
+    return;
+
+  struct sasl_session *session = sasl_new_session(client);
+  if (session == NULL)
+    return;
+
+  *session = record->session;
+  session->client = client;
+}
+
+static void
+sasl_handoff_restore(void)
+{
+  const int fd = sasl_handoff_take();
+
+  if (fd < 0)
+    return;
+
+  struct sasl_handoff *handoff = io_calloc(sizeof(*handoff));
+
+  if (lseek(fd, 0, SEEK_SET) == 0 &&
+      sasl_handoff_read(fd, handoff, sizeof(*handoff)) &&
+      handoff->magic == SASL_HANDOFF_MAGIC &&
+      handoff->version == SASL_HANDOFF_VERSION &&
+      handoff->size == sizeof(*handoff))
+  {
+    memcpy(resume_key, handoff->resume_key, sizeof(resume_key));
+    resume_keylen = handoff->resume_keylen;
+    sasl_pass_enabled = handoff->pass_enabled;
+    memcpy(sasl_mechs, handoff->mechs, sizeof(sasl_mechs));
+    memcpy(sasl_throttles, handoff->throttles, sizeof(sasl_throttles));
+    memcpy(sasl_authcids, handoff->authcids, sizeof(sasl_authcids));
+
+    struct sasl_gen gen;
+    for (size_t i = 0; i < handoff->gens && sasl_handoff_read(fd, &gen, sizeof(gen)); ++i)
+      sasl_gen_set(gen.account, gen.generation);
+
+    struct sasl_cert cert;
+    for (size_t i = 0; i < handoff->certs && sasl_handoff_read(fd, &cert, sizeof(cert)); ++i)
+      sasl_cert_add(cert.certfp, cert.account);
+
+    struct sasl_handoff_session record;
+    for (size_t i = 0; i < handoff->sessions && sasl_handoff_read(fd, &record, sizeof(record)); ++i)
+      sasl_handoff_session(&record);
+    memset(&record, 0, sizeof(record));
+  }
+
+  /* No copy of the key left in freed memory */
+  memset(handoff, 0, sizeof(*handoff));
+  io_free(handoff);
+  close(fd);
+}
+
+
 /* ----------------------------------------------------------------
  * Module init / exit
  * ---------------------------------------------------------------- */
@@ -405,24 +2590,88 @@ static struct Command mechlist_cmd =
 static void
 init_handler(void)
 {
-  cap_register(CAP_SASL, "sasl", "PLAIN");
+  sasl_handoff_restore();
+
+  /* A hold dropped just before the reload still needs its registration */
+  sasl_register_due = true;
+  sasl_register_cap();
   command_add(&authenticate_cmd);
   command_add(&sasl_cmd);
   command_add(&svslogin_cmd);
   command_add(&mechlist_cmd);
+  command_add(&saslkey_cmd);
+  command_add(&saslpass_cmd);
+  command_add(&saslgen_cmd);
+  command_add(&saslcert_cmd);
   hook_install(ircd_hook_client_exit_local, sasl_client_exit_hook, HOOK_PRIORITY_DEFAULT);
+  hook_install(ircd_hook_client_exit_remote, sasl_remote_exit_hook, HOOK_PRIORITY_DEFAULT);
+  event_add(&sasl_hold_event, NULL);
+  event_add(&sasl_authcid_event, NULL);
+  event_add(&sasl_slow_event, NULL);
+  event_add(&sasl_stats_event, NULL);
+
+  for (unsigned int i = 0; i < SASL_WRAP_COUNT; ++i)
+  {
+    sasl_wraps[i].cmd = command_find(sasl_wraps[i].name);
+    if (sasl_wraps[i].cmd)
+    {
+      sasl_wraps[i].handler = sasl_wraps[i].cmd->handlers[UNREGISTERED_HANDLER].handler;
+      sasl_wraps[i].cmd->handlers[UNREGISTERED_HANDLER].handler = sasl_wrappers[i];
+    }
+  }
 }
 
 static void
 exit_handler(void)
 {
+  for (unsigned int i = 0; i < SASL_WRAP_COUNT; ++i)
+    if (sasl_wraps[i].cmd)
+      sasl_wraps[i].cmd->handlers[UNREGISTERED_HANDLER].handler = sasl_wraps[i].handler;
+
   cap_unregister("sasl");
   command_del(&authenticate_cmd);
   command_del(&sasl_cmd);
   command_del(&svslogin_cmd);
   command_del(&mechlist_cmd);
+  command_del(&saslkey_cmd);
+  command_del(&saslpass_cmd);
+  command_del(&saslgen_cmd);
+  command_del(&saslcert_cmd);
   hook_uninstall(ircd_hook_client_exit_local, sasl_client_exit_hook);
-  memset(sessions, 0, sizeof(sessions));
+  hook_uninstall(ircd_hook_client_exit_remote, sasl_remote_exit_hook);
+  event_delete(&sasl_hold_event);
+  event_delete(&sasl_authcid_event);
+  event_delete(&sasl_slow_event);
+  event_delete(&sasl_stats_event);
+  sasl_slow_flush(NULL);
+
+  /* Caches, sessions and holds carry over to the next load */
+  if (!sasl_handoff_save())
+  {
+    /* Nothing would ever lift a hold: abort and register as before */
+    for (unsigned int i = 0; i < SASL_MAX_SESSIONS; ++i)
+    {
+      struct sasl_session *session = &sessions[i];
+
+      if (session->client == NULL)
+        continue;
+
+      if (session->agent[0])
+        sasl_encap(session->agent, "%s %s D A",
+                   session->client->id, session->agent);
+      sasl_end_session(session);
+    }
+
+    /* Nor a PASS hold that is waiting for NICK, USER or CAP END */
+    dlink_node *node, *node_next;
+    DLINK_FOREACH_SAFE(node, node_next, unknown_list.head)
+      sasl_release(node->data);
+  }
+
+  memset(resume_key, 0, sizeof(resume_key));
+  resume_keylen = 0;
+  sasl_gen_clear();
+  sasl_cert_clear();
 }
 
 struct Module module_entry =
@@ -0,0 +1,250 @@
+/*
+ *  match_simd.c - SSE2 nick character scan and casefolded compare
+ *
+ *  Appended by docker/Dockerfile to the libio source that defines
+ *  irccmp(), next to the character tables it reads.  valid_nickname()
+ *  scans with match_nick_span() (docker/patch_match.awk), and irccmp()
+ *  skips the casefold-equal prefix sixteen bytes at a time, leaving the
+ *  rest to the original loop, renamed irccmp_bytewise().
+ *
+ *  Nothing is hard-coded: match_simd_init() reduces IsNickChar() and
+ *  ToLower() to a few byte ranges.  A table that does not reduce, or a
+ *  build without SSE2, keeps the byte loops.
+ *
+ *  Loads may read past the terminating NUL, but never into the next
+ *  page, so they cannot fault.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MATCH_SIMD_MAX_RANGES  6  /* More and the byte loop is faster */
+#define MATCH_SIMD_PAGE     4096
+
+struct match_simd_range
+{
+  unsigned char lo;
+  unsigned char span;  /* hi - lo */
+};
+
+#ifdef __SSE2__
+/* A range as broadcast vectors, ready for match_simd_in() */
+struct match_simd_vrange
+{
+  __m128i lo;
+  __m128i span;
+};
+#endif
+
+static struct
+{
+  bool nick_vector;    /* Nick characters reduced to nick[] */
+  unsigned int nick_count;
+  struct match_simd_range nick[MATCH_SIMD_MAX_RANGES];
+
+  bool fold_vector;    /* ToLower() reduced to fold[] + fold_delta */
+  unsigned int fold_count;
+  struct match_simd_range fold[MATCH_SIMD_MAX_RANGES];
+  unsigned char fold_delta;
+
+#ifdef __SSE2__
+  struct match_simd_vrange vnick[MATCH_SIMD_MAX_RANGES];
+  struct match_simd_vrange vfold[MATCH_SIMD_MAX_RANGES];
+  __m128i vdelta;
+#endif
+} match_simd;
+
+
+/* Collect the runs of bytes for which pred() holds; false if too many */
+static bool
+match_simd_ranges(bool (*pred)(unsigned int), struct match_simd_range *r, unsigned int *count)
+{
+  *count = 0;
+
+  for (unsigned int c = 0; c < 256; )
+  {
+    if (!pred(c))
+    {
+      ++c;
+      continue;
+    }
+
+    const unsigned int lo = c;
+    while (c < 256 && pred(c))
+      ++c;
+
+    if (*count == MATCH_SIMD_MAX_RANGES)
+      return false;
+
+    r[*count].lo = lo;
+    r[*count].span = c - 1 - lo;
+    ++*count;
+  }
+
+  return true;
+}
+
+#ifdef __SSE2__
+static void
+match_simd_broadcast(const struct match_simd_range *r, struct match_simd_vrange *v, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    v[i].lo = _mm_set1_epi8((char)r[i].lo);
+    v[i].span = _mm_set1_epi8((char)r[i].span);
+  }
+}
+#endif
+
+static bool
+match_simd_is_nick(unsigned int c)
+{
+  return IsNickChar(c) != 0;
+}
+
+static bool
+match_simd_is_folded(unsigned int c)
+{
+  return ToLower(c) != c;
+}
+
+void
+match_simd_init(void)
+{
+  memset(&match_simd, 0, sizeof(match_simd));
+
+#ifdef __SSE2__
+  match_simd.nick_vector =
+    match_simd_ranges(match_simd_is_nick, match_simd.nick, &match_simd.nick_count);
+  match_simd_broadcast(match_simd.nick, match_simd.vnick, match_simd.nick_count);
+
+  /* Every folded byte must move by the same amount */
+  if (!match_simd_ranges(match_simd_is_folded, match_simd.fold, &match_simd.fold_count) ||
+      match_simd.fold_count == 0)
+    return;
+
+  match_simd.fold_delta = ToLower(match_simd.fold[0].lo) - match_simd.fold[0].lo;
+  match_simd.vdelta = _mm_set1_epi8((char)match_simd.fold_delta);
+  match_simd_broadcast(match_simd.fold, match_simd.vfold, match_simd.fold_count);
+  match_simd.fold_vector = true;
+
+  for (unsigned int c = 0; c < 256; ++c)
+    if (ToLower(c) != c && (unsigned char)(ToLower(c) - c) != match_simd.fold_delta)
+      match_simd.fold_vector = false;
+
+#ifdef ToUpper
+  /* The prefix skipped as equal must be what irccmp_bytewise() calls equal */
+  for (unsigned int a = 1; a < 256 && match_simd.fold_vector; ++a)
+    for (unsigned int b = 1; b < 256; ++b)
+      if ((ToLower(a) == ToLower(b)) != (ToUpper(a) == ToUpper(b)))
+        match_simd.fold_vector = false;
+#endif
+#endif
+}
+
+/* The tables are static data, so they are complete before main() */
+static void __attribute__((constructor))
+match_simd_startup(void)
+{
+  match_simd_init();
+}
+
+
+#ifdef __SSE2__
+/*
+ * A byte x is in [lo, lo + span] iff (x - lo) <= span as unsigned
+ * bytes, i.e. the saturating (x - lo) - span is zero.
+ */
+static inline __m128i
+match_simd_in(__m128i x, const struct match_simd_vrange *r, unsigned int count)
+{
+  __m128i hit = _mm_setzero_si128();
+
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    const __m128i t = _mm_subs_epu8(_mm_sub_epi8(x, r[i].lo), r[i].span);
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(t, _mm_setzero_si128()));
+  }
+
+  return hit;
+}
+
+static inline __m128i
+match_simd_tolower(__m128i x)
+{
+  const __m128i folded = match_simd_in(x, match_simd.vfold, match_simd.fold_count);
+  return _mm_add_epi8(x, _mm_and_si128(folded, match_simd.vdelta));
+}
+
+/* Sixteen bytes from p stay within p's page */
+static inline bool
+match_simd_safe(const char *p)
+{
+  return ((uintptr_t)p & (MATCH_SIMD_PAGE - 1)) <= MATCH_SIMD_PAGE - 16;
+}
+#endif
+
+size_t
+match_nick_span(const char *s)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  if (match_simd.nick_vector)
+  {
+    for (; match_simd_safe(s + i); i += 16)
+    {
+      const __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+      const unsigned int miss = ~_mm_movemask_epi8(match_simd_in(x, match_simd.vnick, match_simd.nick_count)) & 0xFFFF;
+
+      /* NUL is never a nick character, so the end stops it too */
+      if (miss)
+        return i + __builtin_ctz(miss);
+    }
+  }
+#endif
+
+  while (IsNickChar(s[i]))
+    ++i;
+  return i;
+}
+
+int
+irccmp(const char *s1, const char *s2)
+{
+#ifdef __SSE2__
+  /* Most mismatches, in hash chains and list scans, differ at once */
+  if (match_simd.fold_vector && ToLower(*s1) == ToLower(*s2))
+  {
+    while (match_simd_safe(s1) && match_simd_safe(s2))
+    {
+      const __m128i a = _mm_loadu_si128((const __m128i *)s1);
+      const __m128i b = _mm_loadu_si128((const __m128i *)s2);
+      const unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(match_simd_tolower(a), match_simd_tolower(b)));
+      const unsigned int end = _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()));
+      const unsigned int stop = (~same & 0xFFFF) | end;
+
+      /* First difference or the end of s1: the byte loop decides */
+      if (stop)
+      {
+        s1 += __builtin_ctz(stop);
+        s2 += __builtin_ctz(stop);
+        break;
+      }
+
+      s1 += 16;
+      s2 += 16;
+    }
+  }
+#endif
+
+  return irccmp_bytewise(s1, s2);
+}
@@ -0,0 +1,28 @@
+/*
+ *  match_simd.h - SSE2 nick character scan and casefolded compare
+ *
+ *  Installed into libio/src and included from the end of match.h by
+ *  docker/Dockerfile; the code is match_simd.c, appended to match.c.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef INCLUDED_match_simd_h
+#define INCLUDED_match_simd_h
+
+/* Rederive the vector tables from char_attrs and the case tables; call
+ * after changing either (m_charclass does on every reload) */
+extern void match_simd_init(void);
+
+/* Number of leading nick characters in a NUL terminated string */
+extern size_t match_nick_span(const char *);
+
+/* irccmp() as shipped, still used for the tail the vector loop stops at */
+extern int irccmp_bytewise(const char *, const char *);
+
+#endif
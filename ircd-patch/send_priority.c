@@ -0,0 +1,106 @@
+/*
+ *  send_priority.c - sendto_one() that jumps the link's sendq
+ *
+ *  Appended by docker/Dockerfile to send.c, whose send_format() and
+ *  send_message() it reuses.  The line is queued as usual, so sendq
+ *  limits, statistics and the immediate write attempt are the core's;
+ *  if it is still waiting afterwards, its block is moved from the tail
+ *  to just behind the head (which may be partly written) and behind any
+ *  earlier priority lines, so priority lines keep their order.
+ *
+ *  Priority blocks still queued are told apart by holding a reference
+ *  on each: when ours is the only one left the block has been written
+ *  or dropped, and it is released.  With SEND_PRIORITY_HELD in flight,
+ *  further lines go out in order like any other.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#define SEND_PRIORITY_HELD 64
+
+static struct dbuf_block *send_priority_held[SEND_PRIORITY_HELD];
+
+
+/* Let go of blocks no queue refers to any more */
+static void
+send_priority_purge(void)
+{
+  for (unsigned int i = 0; i < SEND_PRIORITY_HELD; ++i)
+  {
+    if (send_priority_held[i] && send_priority_held[i]->refs == 1)
+    {
+      dbuf_ref_free(send_priority_held[i]);
+      send_priority_held[i] = NULL;
+    }
+  }
+}
+
+static bool
+send_priority_is_held(const struct dbuf_block *block)
+{
+  for (unsigned int i = 0; i < SEND_PRIORITY_HELD; ++i)
+    if (send_priority_held[i] == block)
+      return true;
+  return false;
+}
+
+static bool
+send_priority_hold(struct dbuf_block *block)
+{
+  for (unsigned int i = 0; i < SEND_PRIORITY_HELD; ++i)
+  {
+    if (send_priority_held[i] == NULL)
+    {
+      ++block->refs;
+      send_priority_held[i] = block;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+sendto_one_priority(struct Client *to, const char *pattern, ...)
+{
+  struct Client *link = to->from;
+  va_list args;
+
+  if (IsDead(link))
+    return;  /* This socket has already been marked as dead */
+
+  va_start(args, pattern);
+
+  struct dbuf_block *buffer = dbuf_alloc();
+  send_format(buffer, pattern, args);
+  va_end(args);
+
+  /* Queued at the tail, and written at once if the socket takes it */
+  send_message(link, buffer);
+  send_priority_purge();
+
+  dlink_list *const blocks = &link->connection->buf_sendq.blocks;
+  dlink_node *const node = blocks->tail;
+
+  if (!IsDead(link) && node && node->data == buffer && node != blocks->head &&
+      send_priority_hold(buffer))
+  {
+    dlink_node *after = blocks->head;
+
+    while (after->next != node && send_priority_is_held(after->next->data))
+      after = after->next;
+
+    if (after->next != node)
+    {
+      dlinkDelete(node, blocks);
+      dlinkAddBefore(after->next, buffer, node, blocks);
+    }
+  }
+
+  dbuf_ref_free(buffer);
+}
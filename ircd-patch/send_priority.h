@@ -0,0 +1,22 @@
+/*
+ *  send_priority.h - sendto_one() that jumps the link's sendq
+ *
+ *  Installed next to send.h and included from its end by
+ *  docker/Dockerfile; the code is send_priority.c, appended to send.c.
+ *
+ *  Copyright (c) 2026 Chatik IRC Network
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef INCLUDED_send_priority_h
+#define INCLUDED_send_priority_h
+
+/* sendto_one(), but queued ahead of everything on the link except the
+ * line being written and earlier priority lines (m_sasl's SASL lines) */
+extern void sendto_one_priority(struct Client *, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+#endif